@@ -0,0 +1,311 @@
+#include "allocator.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Allocator micro-benchmarks. Build with `make bench`; the library is
+ * compiled in with a bigger HEAP_SIZE so the indexes have real depth.
+ * `./bench` runs every section, `./bench <section>` just one. */
+
+#define OPS   20000
+#define LIVE  512
+
+static uint32_t lcg_state;
+static uint32_t lcg(void){
+    lcg_state = lcg_state * 1664525U + 1013904223U;
+    return lcg_state >> 8;
+}
+
+static double now_sec(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static int cmp_u64(const void *a, const void *b){
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/* ---- levels: search cost of the size index, random vs address levels ----
+ * Same operation trace every run (fixed workload seed); only the level
+ * choice changes. Random levels give a different cost profile per PRNG
+ * seed, address levels give the same one whatever the seed. */
+static uint64_t hops[OPS];
+
+static void levels_run(allocator_level_mode_t mode, unsigned seed){
+    static void *live[LIVE];
+    memset(live, 0, sizeof live);
+    allocator_set_level_mode(mode);
+    allocator_replay(NULL, 0, seed);            // fresh heaps, seeded
+    lcg_state = 42;
+
+    allocator_heap_stats_t st;
+    size_t n = 0;
+    double t0 = now_sec();
+    for (int op = 0; op < OPS; ++op){
+        int slot = (int)(lcg() % LIVE);
+        if (live[slot]){
+            my_free(live[slot]);
+            live[slot] = NULL;
+            continue;
+        }
+        allocator_heap_stats(&st, NULL);
+        uint64_t before = st.index_hops;
+        live[slot] = malloc_best_fit(16 + lcg() % 1009);
+        allocator_heap_stats(&st, NULL);
+        hops[n++] = st.index_hops - before;
+    }
+    double dt = now_sec() - t0;
+    for (int i = 0; i < LIVE; ++i){
+        my_free(live[i]);
+    }
+
+    uint64_t sum = 0;
+    for (size_t i = 0; i < n; ++i) sum += hops[i];
+    qsort(hops, n, sizeof hops[0], cmp_u64);
+    printf("  %-8s %10u %7zu %7.2f %5llu %5llu %5llu %5llu %8.1f\n",
+           mode == ALLOC_LEVELS_ADDRESS ? "address" : "random", seed, n,
+           (double)sum / (double)n,
+           (unsigned long long)hops[n / 2],
+           (unsigned long long)hops[n * 9 / 10],
+           (unsigned long long)hops[n * 99 / 100],
+           (unsigned long long)hops[n - 1],
+           dt * 1e9 / OPS);
+}
+
+static void bench_levels(void){
+    printf("== levels: index hops per malloc_best_fit (%d ops, %d slots) ==\n", OPS, LIVE);
+    printf("  %-8s %10s %7s %7s %5s %5s %5s %5s %8s\n",
+           "mode", "seed", "allocs", "mean", "p50", "p90", "p99", "max", "ns/op");
+    const unsigned seeds[] = {1, 7, 1234, 0xC0FFEE, 0x9E3779B9U};
+    for (size_t i = 0; i < sizeof seeds / sizeof seeds[0]; ++i)
+        levels_run(ALLOC_LEVELS_RANDOM, seeds[i]);
+    for (size_t i = 0; i < sizeof seeds / sizeof seeds[0]; ++i)
+        levels_run(ALLOC_LEVELS_ADDRESS, seeds[i]);
+    allocator_set_level_mode(ALLOC_LEVELS_RANDOM);
+    allocator_reset_seed();
+    printf("\n");
+}
+
+/* ---- sawtooth: guarded blocks made and freed in waves ----
+ * Every first-fit call gets its own mapping; each wave allocates WAVE of
+ * them then frees them all. Without the mapping cache that is one mmap and
+ * one munmap per block; with it only the first wave maps. */
+#define WAVES 200
+#define WAVE  64
+
+static void sawtooth_run(size_t cache){
+    static void *live[WAVE];
+    allocator_map_stats_t s0, s1;
+    allocator_set_map_cache(cache);
+    allocator_map_stats(&s0);
+    allocator_set_guard_sampling(ALLOC_STRATEGY_FIRST, 1);
+    lcg_state = 42;
+    double t0 = now_sec();
+    for (int w = 0; w < WAVES; ++w){
+        for (int i = 0; i < WAVE; ++i) live[i] = malloc_first_fit(64 + lcg() % 3000);
+        for (int i = 0; i < WAVE; ++i) my_free(live[i]);
+    }
+    double dt = now_sec() - t0;
+    allocator_set_guard_sampling(ALLOC_STRATEGY_FIRST, 0);
+    allocator_map_stats(&s1);
+    printf("  %-8s %8zu %8llu %8llu %8llu %8llu %8.1f\n",
+           cache ? "cache" : "off", cache >> 10,
+           s1.mmaps - s0.mmaps, s1.munmaps - s0.munmaps,
+           s1.reused - s0.reused, s1.parked - s0.parked,
+           dt * 1e9 / (WAVES * WAVE));
+}
+
+static void bench_sawtooth(void){
+    printf("== sawtooth: guarded alloc/free waves (%d x %d blocks) ==\n", WAVES, WAVE);
+    printf("  %-8s %8s %8s %8s %8s %8s %8s\n",
+           "cache", "KiB", "mmaps", "munmaps", "reused", "parked", "ns/op");
+    sawtooth_run(0);
+    sawtooth_run((size_t)64 << 10);
+    sawtooth_run((size_t)4 << 20);
+    allocator_set_map_cache((size_t)4 << 20);
+    printf("\n");
+}
+
+/* ---- warmup: first-touch page faults after startup ----
+ * Each mode runs in a fresh child so nothing is resident yet: allocate
+ * and write WARM_BYTES of first-fit blocks, counting minor faults with
+ * getrusage. "warmup" calls allocator_warmup first (its own faults and
+ * time shown separately). */
+#define WARM_BYTES ((size_t)8 << 20)
+
+static long minor_faults(void){
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_minflt;
+}
+
+static void warm_run(const char *mode){
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) return;
+    if (pid){ waitpid(pid, NULL, 0); return; }
+
+    long f0 = minor_faults();
+    double t0 = now_sec();
+    if (strcmp(mode, "warmup") == 0) allocator_warmup(WARM_BYTES + ((size_t)1 << 20), 4096);
+    long wf = minor_faults() - f0;
+    double wt = now_sec() - t0;
+
+    lcg_state = 42;
+    size_t used = 0, n = 0;
+    f0 = minor_faults();
+    t0 = now_sec();
+    while (used < WARM_BYTES){
+        size_t sz = 64 + lcg() % 4000;
+        char *p = malloc_first_fit(sz);
+        if (!p) break;
+        memset(p, 'w', sz);
+        used += sz; n++;
+    }
+    double dt = now_sec() - t0;
+    printf("  %-8s %8ld %9.2f %8zu %8ld %8.1f\n", mode, wf, wt * 1e3, n,
+           minor_faults() - f0, dt * 1e9 / (double)n);
+    fflush(stdout);
+    _exit(0);
+}
+
+static void bench_warmup(void){
+    printf("== warmup: minor faults writing %zu MiB of first-fit blocks ==\n", WARM_BYTES >> 20);
+    printf("  %-8s %8s %9s %8s %8s %8s\n",
+           "mode", "setup_pf", "setup_ms", "allocs", "faults", "ns/op");
+    warm_run("cold");
+    warm_run("warmup");
+    printf("\n");
+}
+
+/* ---- realloc: growing one large buffer by doubling ----
+ * Large blocks (allocator_set_large_threshold) grow with mremap, so the
+ * cost follows the page count; "copy" does the same growth the classic
+ * way (new block, memcpy, free) for comparison. Every page is written
+ * once before growing so there is real data to move. */
+#define GROW_FROM ((size_t)1 << 20)
+#define GROW_TO   ((size_t)256 << 20)
+
+static void grow_run(int remap){
+    allocator_map_stats_t s0, s1;
+    allocator_map_stats(&s0);
+    char *p = malloc_first_fit(GROW_FROM);
+    memset(p, 'r', GROW_FROM);
+    double spent = 0;
+    for (size_t sz = GROW_FROM; sz < GROW_TO && p; sz *= 2){
+        double t0 = now_sec();
+        char *q;
+        if (remap) q = my_realloc(p, sz * 2);
+        else{
+            q = malloc_first_fit(sz * 2);
+            if (q){ memcpy(q, p, sz); my_free(p); }
+        }
+        spent += now_sec() - t0;
+        if (!q) break;
+        p = q;
+        memset(p + sz, 'r', sz);
+    }
+    my_free(p);
+    allocator_map_stats(&s1);
+    printf("  %-8s %10.2f %8llu %8llu\n", remap ? "mremap" : "copy", spent * 1e3,
+           s1.mremaps - s0.mremaps, s1.mmaps - s0.mmaps);
+}
+
+static void bench_realloc(void){
+    printf("== realloc: grow %zu MiB -> %zu MiB by doubling ==\n", GROW_FROM >> 20, GROW_TO >> 20);
+    printf("  %-8s %10s %8s %8s\n", "how", "grow_ms", "mremaps", "mmaps");
+    allocator_set_large_threshold(GROW_FROM);
+    grow_run(0);
+    grow_run(1);
+    allocator_set_large_threshold(0);
+    printf("\n");
+}
+
+/* ---- fib: Fibonacci vs power-of-two buddy ----
+ * Same size stream (16..600 bytes) into each buddy arena. "fill" rounds
+ * allocate until the arena says no, then free everything: waste is the
+ * share of handed-out block bytes the caller did not ask for (internal
+ * fragmentation), used is how much of the arena those blocks cover.
+ * "churn" keeps up to 4 blocks live at random and times alloc + free. */
+#define FILL_ROUNDS 2000
+#define CHURN_OPS   200000
+
+typedef void* (*bud_alloc_fn)(size_t);
+typedef void  (*bud_stats_fn)(allocator_heap_stats_t*);
+
+static void stats_buddy(allocator_heap_stats_t *st){ allocator_heap_stats(NULL, st); }
+
+static void fib_run(const char *name, bud_alloc_fn alloc, bud_stats_fn stats, size_t arena){
+    static void *blk[256];
+    allocator_heap_stats_t st;
+    double asked = 0, got = 0, used = 0, nblk = 0;
+    lcg_state = 7;
+    for (int r = 0; r < FILL_ROUNDS; ++r){
+        size_t n = 0, req = 0;
+        for (;;){
+            size_t sz = 16 + lcg() % 585;
+            void *p = alloc(sz);
+            if (!p) break;
+            blk[n++] = p; req += sz;
+        }
+        stats(&st);
+        asked += (double)req; got += (double)st.alloc_bytes;
+        used += (double)st.alloc_bytes / (double)arena; nblk += (double)n;
+        while (n) my_free(blk[--n]);
+    }
+    void *live[4] = {0};
+    double t0 = now_sec();
+    for (int op = 0; op < CHURN_OPS; ++op){
+        int slot = (int)(lcg() % 4);
+        if (live[slot]){ my_free(live[slot]); live[slot] = NULL; }
+        else live[slot] = alloc(16 + lcg() % 585);
+    }
+    double dt = now_sec() - t0;
+    for (int i = 0; i < 4; ++i) my_free(live[i]);
+    printf("  %-10s %6zu %8.1f %7.1f%% %7.1f%% %8.1f\n", name, arena,
+           nblk / FILL_ROUNDS, 100.0 * (1.0 - asked / got),
+           100.0 * used / FILL_ROUNDS, dt * 1e9 / CHURN_OPS);
+}
+
+static void bench_fib(void){
+    printf("== fib: buddy variants, 16..600 byte requests ==\n");
+    printf("  %-10s %6s %8s %8s %8s %8s\n",
+           "buddy", "arena", "blocks", "waste", "used", "ns/op");
+    fib_run("binary", malloc_buddy_alloc, stats_buddy, 4096);
+    fib_run("fibonacci", malloc_fib_buddy, allocator_fib_stats, 3728);
+    printf("\n");
+}
+
+typedef struct {
+    const char *name;
+    void      (*run)(void);
+} bench_case;
+
+int main(int argc, char **argv){
+    const bench_case cases[] = {
+        {"levels", bench_levels},
+        {"sawtooth", bench_sawtooth},
+        {"warmup", bench_warmup},
+        {"realloc", bench_realloc},
+        {"fib", bench_fib},
+    };
+    int ran = 0;
+    for (size_t i = 0; i < sizeof cases / sizeof cases[0]; ++i){
+        if (argc > 1 && strcmp(argv[1], cases[i].name) != 0) continue;
+        cases[i].run();
+        ran = 1;
+    }
+    if (!ran){
+        fprintf(stderr, "unknown section '%s'\n", argv[1]);
+        return 1;
+    }
+    return 0;
+}
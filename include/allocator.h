@@ -2,15 +2,113 @@
 #define ALLOCATOR_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 typedef enum {
     ALLOC_STRATEGY_FIRST = 1,
     ALLOC_STRATEGY_NEXT,
     ALLOC_STRATEGY_BEST,
     ALLOC_STRATEGY_WORST,
-    ALLOC_STRATEGY_BUDDY
+    ALLOC_STRATEGY_BUDDY,
+    ALLOC_STRATEGY_FIB
 } allocator_strategy_t;
 
+/* Lock contention counters. wait_ns only accumulates on the slow path. */
+typedef struct {
+    unsigned long long acquisitions;
+    unsigned long long contended;
+    unsigned long long wait_ns;
+} allocator_lock_stats_t;
+
+/* Heap counters maintained on every alloc/free/split/merge, so reading them
+ * never walks a list. Fit heap bytes are payload bytes; buddy bytes are
+ * whole blocks, header included. */
+typedef struct {
+    size_t free_bytes;
+    size_t free_blocks;
+    size_t alloc_bytes;
+    size_t alloc_blocks;
+    unsigned long long splits;
+    unsigned long long merges;
+    unsigned long long failures;
+    unsigned long long index_searches;  /* skip-list descents (fit heap only) */
+    unsigned long long index_hops;      /* nodes stepped over in those descents */
+    size_t committed_bytes;             /* arena memory currently readable/writable */
+} allocator_heap_stats_t;
+
+/* Per-block mappings (guarded and large blocks): real mmap/munmap calls, and how
+ * many requests and releases the mapping cache absorbed instead. */
+typedef struct {
+    unsigned long long mmaps;
+    unsigned long long munmaps;
+    unsigned long long mremaps;         /* large blocks resized in place or moved */
+    unsigned long long reused;          /* served from the cache, no mmap */
+    unsigned long long parked;          /* kept in the cache, no munmap */
+    size_t cached_bytes;
+    size_t cached_blocks;
+} allocator_map_stats_t;
+
+/* Range allocator: the fit strategies over abstract [offset, length)
+ * ranges (file extents, ID spaces) with all bookkeeping kept outside. */
+typedef struct allocator_range allocator_range_t;
+typedef struct {
+    uint64_t managed_bytes;             /* end - base of the managed span */
+    uint64_t free_bytes;
+    uint64_t largest_free;
+    size_t   free_ranges;
+    size_t   nodes_left;                /* free-range slots still unused */
+} allocator_range_stats_t;
+
+/* How skip-list node heights are chosen: from the per-shard PRNG, or from
+ * a hash of the block's offset in its shard (same shape whatever the
+ * operation order). Affects blocks indexed after the switch. */
+typedef enum {
+    ALLOC_LEVELS_RANDOM = 0,
+    ALLOC_LEVELS_ADDRESS
+} allocator_level_mode_t;
+
+/* Called before an allocation returns NULL, with no allocator lock held.
+ * Return nonzero after releasing memory to retry, 0 to give up. */
+typedef int (*allocator_oom_handler_t)(size_t size, allocator_strategy_t strategy);
+
+/* Failure counters. by_strategy is indexed by allocator_strategy_t;
+ * by_class[k] counts sizes in (2^(k-1), 2^k], the last class takes the rest. */
+#define ALLOC_FAIL_CLASSES 32
+typedef struct {
+    unsigned long long by_strategy[ALLOC_STRATEGY_FIB + 1];
+    unsigned long long by_class[ALLOC_FAIL_CLASSES];
+} allocator_oom_stats_t;
+
+/* One recorded heap event (see allocator_trace_start). For frees, strategy
+ * is ALLOC_STRATEGY_BUDDY or ALLOC_STRATEGY_FIB for blocks of those arenas
+ * and 0 for fit-heap blocks. A resize is a buddy block grown or shrunk in
+ * place by realloc (size is the new request). offset is the payload offset
+ * inside the shard (or buddy, or Fibonacci) arena. Buddy tail trimming is
+ * not recorded: replay with the setting the trace was taken under. */
+enum { ALLOC_TRACE_ALLOC = 1, ALLOC_TRACE_FREE = 2, ALLOC_TRACE_RESIZE = 3 };
+typedef struct {
+    unsigned char  op;
+    unsigned char  strategy;
+    unsigned short shard;
+    size_t size;
+    size_t offset;
+} allocator_trace_event_t;
+
+/* One block as seen by allocator_walk / allocator_scan_roots. size is the
+ * usable payload (the request rounded up, plus any tail too small to split;
+ * for guarded and large blocks exactly what was asked for). arena is the shard index,
+ * or ALLOC_ARENA_BUDDY / _GUARD / _LARGE / _FIB. */
+enum { ALLOC_ARENA_BUDDY = -1, ALLOC_ARENA_GUARD = -2, ALLOC_ARENA_LARGE = -3,
+       ALLOC_ARENA_FIB = -4 };
+typedef struct {
+    void  *ptr;
+    size_t size;
+    int    allocated;        /* 0 = free, or queued by my_free_async */
+    int    arena;
+} allocator_block_t;
+typedef void (*allocator_walk_fn)(const allocator_block_t *blk, void *arg);
+typedef void (*allocator_root_fn)(const void *slot, const allocator_block_t *blk, void *arg);
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -20,12 +118,138 @@ void* malloc_next_fit(size_t size);
 void* malloc_best_fit(size_t size);
 void* malloc_worst_fit(size_t size);
 void* malloc_buddy_alloc(size_t size);
+/* Fibonacci buddy: own arena, block sizes 16 * Fibonacci numbers, so less
+ * of each block is wasted than with powers of two. my_free releases it. */
+void* malloc_fib_buddy(size_t size);
 
 void my_free(void *ptr);
+/* Resize a block from any allocator here. NULL ptr allocates (first fit),
+ * size 0 frees and returns NULL. Large blocks are grown with mremap (no
+ * copy), buddy blocks as realloc_buddy; fit and Fibonacci blocks stay put
+ * (whole block kept, no tail split off) if they have room, else move to a
+ * new block of the same kind (fit blocks by first fit). On failure
+ * returns NULL and ptr is untouched. A successful resize calls on_free(ptr)
+ * then on_alloc(result), even in place. */
+void* my_realloc(void *ptr, size_t size);
+/* Buddy blocks: grow in place by absorbing free higher buddies, shrink in
+ * place by freeing upper halves, move only when neither works. Same NULL /
+ * 0 rules as my_realloc. Any other pointer (such as a guarded block that
+ * sampling made of a malloc_buddy_alloc) is resized as my_realloc would. */
+void* realloc_buddy(void *ptr, size_t size);
+/* Buddy tail trimming (off by default): keep only the request rounded up
+ * to 64 bytes of the power-of-two block it was cut from and free the rest
+ * as smaller buddy blocks right away. Applies to later allocations. */
+void allocator_set_buddy_trim(int on);
+/* Queue ptr for freeing and return at once; coalescing happens on the next
+ * allocation from the owning shard or on allocator_drain_async(). */
+void my_free_async(void *ptr);
+void allocator_drain_async(void);
 
 allocator_strategy_t allocator_current_strategy(void);
 const char* allocator_strategy_name(allocator_strategy_t strategy);
 
+/* Snapshot of the fit-heap and buddy lock counters; either may be NULL. */
+void allocator_lock_stats(allocator_lock_stats_t *heap, allocator_lock_stats_t *buddy);
+/* Same counters for the Fibonacci buddy arena's lock. */
+void allocator_fib_lock_stats(allocator_lock_stats_t *fib);
+/* Snapshot of the fit-heap (all shards) and buddy counters; either may be NULL. */
+void allocator_heap_stats(allocator_heap_stats_t *heap, allocator_heap_stats_t *buddy);
+/* Same counters for the Fibonacci buddy arena (bytes are whole blocks). */
+void allocator_fib_stats(allocator_heap_stats_t *fib);
+
+/* Install the OOM handler (NULL removes it); returns the previous one. */
+allocator_oom_handler_t allocator_set_oom_handler(allocator_oom_handler_t fn);
+void allocator_oom_stats(allocator_oom_stats_t *out);
+
+/* Debug: serve one in every_n calls of strategy from a private mapping with
+ * the payload butted against a PROT_NONE page (0 = off, 1 = every call), so
+ * overflows fault on the spot. my_free releases those like any other block. */
+void allocator_set_guard_sampling(allocator_strategy_t strategy, unsigned every_n);
+/* Released per-block mappings are kept (MADV_FREE'd) up to this many bytes
+ * and reused before mapping again; 0 turns that off. Setting it unmaps
+ * whatever is cached. Default 4 MiB. */
+void allocator_set_map_cache(size_t bytes);
+/* Fit requests of at least bytes get a mapping of their own instead of a
+ * shard block (0 = off, the default); my_realloc resizes those with
+ * mremap. They are not bound by the heap limit. */
+void allocator_set_large_threshold(size_t bytes);
+void allocator_map_stats(allocator_map_stats_t *out);
+
+/* Skip-list level seed. Applies now and whenever a heap is (re)built;
+ * reset goes back to the built-in default. */
+void allocator_set_seed(unsigned int seed);
+void allocator_reset_seed(void);
+void allocator_set_level_mode(allocator_level_mode_t mode);
+/* Fit-heap shards reserve a large address range up front and commit it as
+ * they grow; this caps how far one shard may grow (bytes, clamped to the
+ * build's HEAP_SIZE..HEAP_RESERVE). Default: the whole reservation. */
+void allocator_set_heap_limit(size_t per_shard);
+/* Fault memory in up front instead of on first touch: builds every shard,
+ * commits and prefaults heap_bytes of each (capped by the heap limit) and
+ * prefaults the first buddy_bytes of the buddy arena; 0 on success, -1 if
+ * some of it could not be committed. Live blocks are left untouched, and
+ * frees never trim a shard back below heap_bytes afterwards. */
+int  allocator_warmup(size_t heap_bytes, size_t buddy_bytes);
+
+/* Record heap events into buf (up to cap); stop returns how many were kept. */
+void   allocator_trace_start(allocator_trace_event_t *buf, size_t cap);
+size_t allocator_trace_stop(void);
+/* Wipe all heaps (live blocks are lost), seed them, re-run a trace. Returns
+ * n if every allocation landed at its recorded offset, otherwise the index
+ * of the first event that diverged. n = 0 just gives fresh seeded heaps. */
+size_t allocator_replay(const allocator_trace_event_t *ev, size_t n, unsigned int seed);
+
+/* Base and usable size of the live allocation whose payload holds p (any
+ * byte of it, not just the start); either out pointer may be NULL. Returns
+ * 0 if p is not inside a live block. A few bitmap word reads plus at most
+ * one top-level word per 2 MiB of arena; no heap walk. */
+int allocator_lookup(const void *p, void **base, size_t *size);
+/* Visit every block (free and live) of every arena in address order per
+ * arena; returns how many. fn runs under the arena lock and must not call
+ * back into the allocator; it may be NULL to just count. */
+size_t allocator_walk(allocator_walk_fn fn, void *arg);
+/* Treat each aligned word in [lo, hi) as a possible pointer; call fn for
+ * every one that lands inside a live payload. Returns the number of hits. */
+size_t allocator_scan_roots(const void *lo, const void *hi, allocator_root_fn fn, void *arg);
+
+/* Remember the caller of one in every_n allocations (0 = off) so the leak
+ * report can group live blocks by where they came from. */
+void allocator_set_site_sampling(unsigned every_n);
+/* Write the live blocks, grouped by size and sampled call site, to fd
+ * (fd < 0 just counts); returns how many live blocks there are. The
+ * at_exit variant runs it from atexit, fd < 0 turns that off again. */
+size_t allocator_leak_report(int fd);
+void   allocator_leak_report_at_exit(int fd);
+
+/* Range allocator. create manages [base, base+length), all free, with room
+ * to track max_free disjoint free ranges (metadata lives in its own
+ * mapping; the managed space is never touched). alloc takes len with
+ * FIRST/NEXT/BEST/WORST fit and stores the start in *off. free hands back
+ * exactly what was taken (the length is not recorded) and merges it with
+ * free neighbours. add puts more free space under management; it must lie
+ * outside the current span, which grows to cover it (a gap in between
+ * counts as allocated and may be handed in later with free). All return 0, or -1 with errno ENOMEM (nothing fits) or
+ * EINVAL (bad argument, out of span, overlaps free space, or no node left
+ * to track a new disjoint range). Each range has its own lock. */
+allocator_range_t* allocator_range_create(uint64_t base, uint64_t length, size_t max_free);
+void allocator_range_destroy(allocator_range_t *r);
+int  allocator_range_alloc(allocator_range_t *r, uint64_t len,
+                           allocator_strategy_t strategy, uint64_t *off);
+int  allocator_range_free(allocator_range_t *r, uint64_t off, uint64_t len);
+int  allocator_range_add(allocator_range_t *r, uint64_t off, uint64_t len);
+void allocator_range_stats(allocator_range_t *r, allocator_range_stats_t *out);
+
+/* Event hooks. The library only holds weak references to these: define
+ * any of them in your program and the allocator calls it, leave them out
+ * and it costs one untaken branch. on_alloc/on_free see successful public
+ * calls (frees of pointers that were really live), with no allocator lock
+ * held. The arena hooks fire after each mmap/munmap of an arena or guarded
+ * mapping, possibly under an allocator lock: do not allocate from them. */
+void allocator_on_alloc(void *ptr, size_t size, allocator_strategy_t strategy);
+void allocator_on_free(void *ptr);
+void allocator_on_arena_map(void *base, size_t len);
+void allocator_on_arena_unmap(void *base, size_t len);
+
 #ifdef __cplusplus
 }
 #endif
@@ -5,7 +5,9 @@
    if split happen then we go to the leftover part
  - Buddy alloc got its own 4KB area (we test that alone)
  Rules:
- - malloc_*: if size==0 or no space, just return NULL
+ - malloc_*: if size==0 or no space, just return NULL (errno = ENOMEM when
+   no space; the OOM handler gets a chance to free stuff and ask for a retry)
+ - mmap failing is "no space" too, never exit() from inside the allocator
  - my_free : no print error, if bad pointer or double free, just ignore quietly
  - Tiny tails: if after split the leftover too small (can’t hold header+MIN_TAIL),
    then give whole block to user (no tiny junk block left)
@@ -14,18 +16,31 @@
  - Skip list level use fixed-seed tiny PRNG (no libc rand), so same every run
 let s go 
 */
+#define _GNU_SOURCE
 #include "allocator.h"
 
+#include <errno.h>
+#include <linux/futex.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 
-#define HEAP_SIZE 4096
+#ifndef HEAP_SIZE
+#define HEAP_SIZE 4096                   // per shard
+#endif
 #define MIN_TAIL  32
 
 #define MAGIC_F   0xFEEDFACEU
 #define MAGIC_A   0xDEADBEEFU
+#define MAGIC_Q   0xA5F00D5AU            // allocated, parked on an async queue
+#define MAGIC_G   0x6A4D0BADU            // allocated in its own guarded mapping
+#define MAGIC_L   0x1A26EB10U            // large block, own unguarded mapping
 
 
 // this is used for debugging 
@@ -36,26 +51,172 @@ let s go
   #define DBG(...) ((void)0)
 #endif
 
+/* Sanitizer annotations (build flag, off by default)
+ *   -DMMU_ASAN     (with -fsanitize=address)  shadow poisoning
+ *   -DMMU_VALGRIND (needs valgrind/memcheck.h) memcheck client requests
+ * Free payloads and the headers of allocated blocks are made no-access,
+ * headers of free blocks stay open since every search walks them. A user
+ * block is opened for exactly the bytes asked for, so even the rounding
+ * slack at its end is caught. Metadata of allocated blocks is only read
+ * through the peek helpers below.
+ */
+#if defined(MMU_ASAN)
+  #include <sanitizer/asan_interface.h>
+  #define POISON(p,n)         ASAN_POISON_MEMORY_REGION((p),(n))
+  #define UNPOISON_META(p,n)  ASAN_UNPOISON_MEMORY_REGION((p),(n))
+  #define MARK_ALLOC(p,n)     ASAN_UNPOISON_MEMORY_REGION((p),(n))
+  #define MARK_FREE(p,n)      ASAN_POISON_MEMORY_REGION((p),(n))
+  #define MARK_RESIZE(p,n,c)  do{ ASAN_UNPOISON_MEMORY_REGION((p),(n)); \
+                                  ASAN_POISON_MEMORY_REGION((char*)(p) + (n), (c) - (n)); }while(0)
+  #define NOSAN               __attribute__((no_sanitize_address))
+  #define PEEK_BEGIN()        ((void)0)
+  #define PEEK_END()          ((void)0)
+#elif defined(MMU_VALGRIND)
+  #include <valgrind/memcheck.h>
+  #define POISON(p,n)         VALGRIND_MAKE_MEM_NOACCESS((p),(n))
+  #define UNPOISON_META(p,n)  VALGRIND_MAKE_MEM_DEFINED((p),(n))
+  #define MARK_ALLOC(p,n)     VALGRIND_MALLOCLIKE_BLOCK((p),(n),0,0)
+  #define MARK_FREE(p,n)      do{ VALGRIND_FREELIKE_BLOCK((p),0); \
+                                  VALGRIND_MAKE_MEM_NOACCESS((p),(n)); }while(0)
+  // old size unknown here: re-register, the grown bytes count as defined
+  #define MARK_RESIZE(p,n,c)  do{ VALGRIND_FREELIKE_BLOCK((p),0); \
+                                  VALGRIND_MALLOCLIKE_BLOCK((p),(n),0,0); \
+                                  VALGRIND_MAKE_MEM_DEFINED((p),(n)); (void)(c); }while(0)
+  #define NOSAN
+  #define PEEK_BEGIN()        VALGRIND_DISABLE_ERROR_REPORTING
+  #define PEEK_END()          VALGRIND_ENABLE_ERROR_REPORTING
+#else
+  #define POISON(p,n)         ((void)(p), (void)(n))
+  #define UNPOISON_META(p,n)  ((void)(p), (void)(n))
+  #define MARK_ALLOC(p,n)     ((void)(p), (void)(n))
+  #define MARK_FREE(p,n)      ((void)(p), (void)(n))
+  #define MARK_RESIZE(p,n,c)  ((void)(p), (void)(n), (void)(c))
+  #define NOSAN
+  #define PEEK_BEGIN()        ((void)0)
+  #define PEEK_END()          ((void)0)
+#endif
+
+/* Static probes (build flag, the Makefile sets it when sys/sdt.h is found)
+ *   -DMMU_USDT (needs sys/sdt.h, systemtap-sdt-dev) USDT probes, provider "mmu"
+ * Each probe is a nop plus an ELF note until a tracer attaches, so they
+ * stay in release builds. bpftrace -l 'usdt:./prog:mmu:*' lists them:
+ *   alloc__entry(strategy, size)  alloc__return(strategy, size, ptr)
+ *   free__entry(ptr)              free__return(ptr, freed)
+ *   split(shard, need, tail)      merge(shard, size, joined)
+ *   buddy__split(order)           buddy__merge(order)
+ *   arena__map(base, len)         arena__unmap(base, len)
+ *   heap__grow(shard, bytes)
+ */
+#if defined(MMU_USDT)
+  #include <sys/sdt.h>
+  #define PROBE1(n,a)         DTRACE_PROBE1(mmu, n, a)
+  #define PROBE2(n,a,b)       DTRACE_PROBE2(mmu, n, a, b)
+  #define PROBE3(n,a,b,c)     DTRACE_PROBE3(mmu, n, a, b, c)
+#else
+  #define PROBE1(n,a)         ((void)(a))
+  #define PROBE2(n,a,b)       ((void)(a), (void)(b))
+  #define PROBE3(n,a,b,c)     ((void)(a), (void)(b), (void)(c))
+#endif
+
+// requests are rounded to 8 so every header starts on a shadow granule
+#define ALIGN_UP(n) (((n) + 7) & ~(size_t)7)
+
+/* Locks
+ * Fit heap and buddy arena each get their own lock so they never serialize
+ * each other. Lock word: 0 = free, 1 = held, 2 = held and someone may sleep.
+ * Take: one CAS on the fast path, then spin a bit (holders are short),
+ * then park on the futex. Drop: only pay the wake syscall if word was 2.
+ * Counters are bumped while holding the lock, so no atomics needed there.
+ */
+#define LK_SPIN 128
+
+typedef struct {
+    _Atomic uint32_t word;
+    uint64_t acq;                    // all acquisitions
+    uint64_t contended;              // ones that missed the fast path
+    uint64_t wait_ns;                // time spent spinning/sleeping
+} lk_t;
+
+static inline void cpu_relax(void){
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+static uint64_t now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+static void lk_take(lk_t *l){
+    uint32_t c = 0;
+    if (atomic_compare_exchange_strong_explicit(&l->word, &c, 1,
+            memory_order_acquire, memory_order_relaxed)){
+        l->acq++;
+        return;
+    }
+    uint64_t t0 = now_ns();
+    for (int i=0;i<LK_SPIN;i++){
+        cpu_relax();
+        c = 0;
+        if (atomic_load_explicit(&l->word, memory_order_relaxed) == 0 &&
+            atomic_compare_exchange_weak_explicit(&l->word, &c, 1,
+                memory_order_acquire, memory_order_relaxed)) goto got;
+    }
+    // mark "waiters maybe" and sleep until we swap 0 -> 2 ourselves
+    c = atomic_exchange_explicit(&l->word, 2, memory_order_acquire);
+    while (c != 0){
+        syscall(SYS_futex, &l->word, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+        c = atomic_exchange_explicit(&l->word, 2, memory_order_acquire);
+    }
+got:
+    l->acq++;
+    l->contended++;
+    l->wait_ns += now_ns() - t0;
+}
+static void lk_drop(lk_t *l){
+    if (atomic_exchange_explicit(&l->word, 0, memory_order_release) == 2)
+        syscall(SYS_futex, &l->word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
 /* Free-block header (main heap
  * This header sit right before user data bytes.
  * It lives in two lists:
  *   1) Address list:  aprev <-> this <-> anext   (so we can merge neighbors)
- *   2) Size index:    snext[level]               (skip list for best/worst fit)
+ *   2) Size index:    sk.snext[level]            (skip list for best/worst fit)
+ * It is also the node of the range allocator, which keeps it out of band.
  */
 #define SKLVL 6
 
+// skip-list node, shared with the range allocator; key is what it sorts by
+typedef struct sknode {
+    size_t key;
+    struct sknode *snext[SKLVL];     // forward pointers of skip-list per level
+    int lvl;                         // height 
+} sknode_t;
+typedef struct { sknode_t *head[SKLVL]; } sklist_t;
+
 typedef struct free_blk {
-    size_t sz;                       // payload size in bytes
+    union {
+        sknode_t sk;                 // first, so &blk->sk == blk
+        size_t   sz;                 // payload size in bytes (the index key)
+    };
     struct free_blk *anext;          // thsi is address-ordered list (next/prev)
     struct free_blk *aprev;
-    struct free_blk *snext[SKLVL];   // forward pointers of skip-list per level
-    int lvl;                         // height 
     uint32_t magic;             
     uint8_t  is_free;                
 } free_blk_t;
 
 #define HDRSZ ((size_t)sizeof(free_blk_t))
 
+/* Fit list: the free side of a fit engine (see Fit engine below) */
+typedef struct fitlist {
+    free_blk_t *head;                    // address-sorted list head
+    free_blk_t *rover;                   // next-fit rover
+    sklist_t sidx;                       // size index
+} fitlist_t;
+
 /*Buddy header (separate arena)
 Classic buddy: block size = 2^order. Only merges with exact buddy of same order
  */
@@ -68,138 +229,652 @@ typedef struct bud {
 } bud_t;
 
 #define BUDHDR ((size_t)sizeof(bud_t))
+
+// magic of a maybe-allocated (so maybe poisoned) header
+static NOSAN uint32_t peek_magic(const uint32_t *m){
+    PEEK_BEGIN();
+    uint32_t v = *(const volatile uint32_t*)m;
+    PEEK_END();
+    return v;
+}
+// is the buddy header at m a free block of this order? m may be allocated
+static NOSAN int bud_free_at(const bud_t *m, uint8_t order){
+    PEEK_BEGIN();
+    int r = ((const volatile bud_t*)m)->is_free && ((const volatile bud_t*)m)->order == order;
+    PEEK_END();
+    return r;
+}
 #define MAXORD 13                    // initial BB = 2^(MAXORD-1)=4096
+#define BUD_SIZE ((size_t)1 << (MAXORD-1))
 
-// Main code 
-static void  *heap0      = NULL;
-static void  *heap0_end  = NULL;
-static int    heap0_inited = 0;
+/* Stats
+ * Running counters kept next to the structures they describe and bumped
+ * under the same lock, so a query is just a copy (no list walk).
+ * Fit heap: bytes are payload bytes. Buddy: bytes are whole blocks.
+ * Free side is counted where blocks enter/leave the free structures (size
+ * index / order lists), splits in smt()/bgb(), merges in cola()/bfm().
+ */
+typedef struct {
+    size_t   free_bytes, free_blocks;
+    size_t   alloc_bytes, alloc_blocks;
+    uint64_t splits, merges;
+    uint64_t idx_searches, idx_hops;     // skip-list descents / nodes stepped over
+} hstat_t;
+
+/* Out of memory
+ * Failures are counted per strategy and per power-of-two size class
+ * (class k = sizes in (2^(k-1), 2^k], last class takes the rest). Then the
+ * handler, if any, runs with no lock held so it may my_free() freely; a
+ * nonzero return means "I released something, try again".
+ */
+static _Atomic(allocator_oom_handler_t) oom_fn = NULL;
+static _Atomic uint64_t fail_strat[ALLOC_STRATEGY_FIB + 1];
+static _Atomic uint64_t fail_class[ALLOC_FAIL_CLASSES];
+
+static int size_class(size_t size){
+    int k = 0;
+    while (k < ALLOC_FAIL_CLASSES-1 && ((size_t)1 << k) < size) k++;
+    return k;
+}
+static int oom_retry(size_t size, int strategy){
+    atomic_fetch_add_explicit(&fail_strat[strategy], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&fail_class[size_class(size)], 1, memory_order_relaxed);
+    errno = ENOMEM;
+    allocator_oom_handler_t fn = atomic_load_explicit(&oom_fn, memory_order_acquire);
+    return fn ? fn(size, (allocator_strategy_t)strategy) : 0;
+}
+
+/* Hooks
+ * Weak references: a program that defines allocator_on_alloc & co. (see
+ * allocator.h) gets them called, everyone else pays one never-taken
+ * branch on an address the linker already fixed. Alloc/free hooks run
+ * with no allocator lock held, the arena ones right after the mmap/munmap
+ * and possibly under a lock, so those must not call back in.
+ */
+extern void allocator_on_alloc(void *ptr, size_t size, allocator_strategy_t strategy) __attribute__((weak));
+extern void allocator_on_free(void *ptr) __attribute__((weak));
+extern void allocator_on_arena_map(void *base, size_t len) __attribute__((weak));
+extern void allocator_on_arena_unmap(void *base, size_t len) __attribute__((weak));
+
+#define HOOK(fn, ...) do{ if (__builtin_expect(fn != NULL, 0)) fn(__VA_ARGS__); }while(0)
+
+/* Shards
+ * The fit heap is split into NSHARD independent heaps, each with its own
+ * arena, address list, size index, rover and lock. A thread sticks to one
+ * home shard (handed out round-robin on first use) and only spills to the
+ * others when home is full, so every search still is exact first/best/...
+ * fit inside one shard. All arenas come from one mapping laid out back to
+ * back, so my_free finds the owner with a subtract + divide, no lookup.
+ */
+#ifndef NSHARD
+#define NSHARD 4
+#endif
+
+/* Reserve / commit
+ * Each shard owns HEAP_RESERVE bytes of address space, reserved PROT_NONE
+ * in that one mapping, and only its front is ever usable: HEAP_SIZE at
+ * bootstrap, then HEAP_GROW sized steps (mprotect) whenever the shard
+ * cannot serve a request, up to heap_limit. New memory is a free block
+ * right after the old end, so it merges with a free tail like any other
+ * neighbour and the shard stays one contiguous range. A big free block at
+ * the end is cut back again (heap_trim). Reserved pages cost no RSS, so
+ * RSS follows what was committed.
+ */
+#ifndef HEAP_RESERVE
+#define HEAP_RESERVE ((size_t)64 << 20)  // per shard, address space only
+#endif
+#define HEAP_GROW    ((size_t)64 << 10)  // commit step
+_Static_assert(HEAP_RESERVE >= HEAP_SIZE, "HEAP_RESERVE must cover HEAP_SIZE");
+_Static_assert(HEAP_RESERVE % 65536 == 0, "HEAP_RESERVE must be page aligned");
+
+static _Atomic size_t heap_limit = HEAP_RESERVE;
+static _Atomic size_t page_sz = 0;
+
+static size_t sys_page(void){
+    if (!page_sz) page_sz = (size_t)sysconf(_SC_PAGESIZE);
+    return page_sz;
+}
+
+/* Prefault: allocator_warmup faults committed pages in right away instead
+ * of on first touch, so the first allocations after startup take no minor
+ * faults. The shard reservation is PROT_NONE, which MAP_POPULATE cannot
+ * help with, so this runs after the commit.
+ */
+// fault [p, p+len) in for writing without changing a byte (live data ok)
+static NOSAN void prefault(void *p, size_t len){
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(p, len, MADV_POPULATE_WRITE) == 0) return;
+#endif
+    size_t pg = sys_page();
+    for (size_t off = 0; off < len; off += pg){
+        unsigned char *q = (unsigned char*)p + off;
+        unsigned char v = __atomic_load_n(q, __ATOMIC_RELAXED);
+        // a CAS to the same value still writes; an idempotent or may not
+        __atomic_compare_exchange_n(q, &v, v, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+}
 
-static free_blk_t *alist_head = NULL;    // address-sorted list head 
-static free_blk_t *rover      = NULL;    // next-fit rover     
+typedef struct {
+    _Alignas(64) lk_t lk;                // guards everything below
+    void  *heap0;
+    void  *heap0_end;                    // end of the managed part, grows
+    size_t commit;                       // bytes from heap0 that are RW
+    uint64_t *bmap;                      // block starts, see Arena registry
+    int    inited;
+    fitlist_t fl;                        // free blocks
+    hstat_t st;
+    uint32_t prng;                       // skip-list level generator
+    _Alignas(64) _Atomic(free_blk_t*) pending;  // my_free_async stack, no lock
+} heap_t;
 
-static int current_strategy = 0;
+static heap_t shards[NSHARD];
+static char  *shard_base = NULL;         // NSHARD * HEAP_RESERVE + bitmaps, one mmap
+static _Atomic int shard_mapped = 0;
+static lk_t   shard_map_lk;
+static _Atomic unsigned shard_next = 0;
+static _Thread_local int home_shard = -1;
 
-// Size-index 
-static struct { free_blk_t *head[SKLVL]; } sidx;
+static _Atomic int current_strategy = 0;
+
+// last strategy used anywhere; only stored when it changes, so threads
+// sticking to one strategy never write (and bounce) the shared line
+static inline void note_strategy(int strategy){
+    if (atomic_load_explicit(&current_strategy, memory_order_relaxed) != strategy)
+        atomic_store_explicit(&current_strategy, strategy, memory_order_relaxed);
+}
 
 // Buddy areaz
 static void  *b_arena  = NULL;
-static int    b_inited = 0;
+static _Atomic int b_inited = 0;         // set last, read by my_free unlocked
 static bud_t *bfl[MAXORD];
+static hstat_t bst;
+static lk_t   bud_lk;                    // guards b_arena + bfl + bst + b_bmap
+static lk_t   fib_lk;                    // guards f_arena + ffl + fst + f_bmap
+
+/* Arena registry
+ * Every arena knows where its block headers start: one bit per ARENA_GRAN
+ * bytes, set exactly at the first byte of each block header (free or not),
+ * flipped only under the arena's lock where blocks are born (bootstrap,
+ * split) and die (merge). Shard bitmaps sit right after the shard arenas
+ * in the same mapping, the buddy one is static. Finding the arena is pure
+ * range math (shards back to back, one buddy range) and guarded mappings
+ * live in a small hash set, so my_free never reads a header it has not
+ * proven is there: any pointer is safe to pass and costs O(1) to reject.
+ */
+#define ARENA_GRAN 8                     // = ALIGN_UP step, headers land on it
+#define BMAP_WORDS(len) (((len) / ARENA_GRAN + 63) / 64)
+#define BSUM_WORDS(len) ((BMAP_WORDS(len) + 63) / 64)
+#define BTOP_WORDS(len) ((BSUM_WORDS(len) + 63) / 64)
+#define BMAP_ALL(len)   (BMAP_WORDS(len) + BSUM_WORDS(len) + BTOP_WORDS(len))
+#define BMAP_BYTES(len) (BMAP_ALL(len) * 8)
+
+/* Each bitmap is followed by two summary levels: one bit per bitmap word
+ * that has any bit set (a summary word covers 32 KiB of arena), then one
+ * bit per summary word that has any bit set (a top word covers 2 MiB).
+ * The nearest block start in either direction costs a word read per level
+ * plus a scan of the top level: at most one word per 2 MiB between the
+ * two (32 across a whole 64 MiB shard reservation), however big the free
+ * block in between. */
+static uint64_t b_bmap[BMAP_ALL(BUD_SIZE)];
 
-#define free_head    alist_head
-#define size_index   sidx
-#define next_rover   rover
+static inline uint64_t bm_ld(const uint64_t *w){ return __atomic_load_n(w, __ATOMIC_RELAXED); }
+static inline void bm_st(uint64_t *w, uint64_t v){ __atomic_store_n(w, v, __ATOMIC_RELAXED); }
 
-static uint32_t prng_state = 0x9E3779B9U; // golden ratio seed 
-static inline uint32_t xr(void){
-    uint32_t x = prng_state;
+// writers hold the arena lock; my_free_async reads without it. A summary
+// bit is set exactly while the word below it is non-zero.
+static inline void bm_set(uint64_t *m, size_t len, size_t off){
+    size_t i = off / ARENA_GRAN, w = i >> 6, sw = w >> 6;
+    uint64_t *sum = m + BMAP_WORDS(len), *top = sum + BSUM_WORDS(len);
+    uint64_t x = bm_ld(&m[w]);
+    bm_st(&m[w], x | (1ULL << (i & 63)));
+    if (x) return;                       // summaries already say so
+    uint64_t y = bm_ld(&sum[sw]);
+    bm_st(&sum[sw], y | (1ULL << (w & 63)));
+    if (!y) bm_st(&top[sw >> 6], bm_ld(&top[sw >> 6]) | (1ULL << (sw & 63)));
+}
+static inline void bm_clr(uint64_t *m, size_t len, size_t off){
+    size_t i = off / ARENA_GRAN, w = i >> 6, sw = w >> 6;
+    uint64_t *sum = m + BMAP_WORDS(len), *top = sum + BSUM_WORDS(len);
+    uint64_t x = bm_ld(&m[w]) & ~(1ULL << (i & 63));
+    bm_st(&m[w], x);
+    if (x) return;
+    uint64_t y = bm_ld(&sum[sw]) & ~(1ULL << (w & 63));
+    bm_st(&sum[sw], y);
+    if (!y) bm_st(&top[sw >> 6], bm_ld(&top[sw >> 6]) & ~(1ULL << (sw & 63)));
+}
+// is there a block header at arena offset off (arena is len bytes)?
+static inline int bm_has(const uint64_t *m, size_t len, uintptr_t off){
+    if (off >= len || off % ARENA_GRAN) return 0;
+    size_t i = off / ARENA_GRAN;
+    return (int)((bm_ld(&m[i >> 6]) >> (i & 63)) & 1);
+}
+// highest / lowest set bit of a non-zero word
+#define HI(x) (63 - (size_t)__builtin_clzll(x))
+#define LO(x) ((size_t)__builtin_ctzll(x))
+// last block start at or below offset off, SIZE_MAX if none
+static size_t bm_prev(const uint64_t *m, size_t len, size_t off){
+    const uint64_t *sum = m + BMAP_WORDS(len), *top = sum + BSUM_WORDS(len);
+    size_t i = off / ARENA_GRAN, w = i >> 6;
+    uint64_t x = bm_ld(&m[w]) & (~0ULL >> (63 - (i & 63)));
+    if (!x){
+        if (!w--) return SIZE_MAX;
+        size_t sw = w >> 6;
+        uint64_t y = bm_ld(&sum[sw]) & (~0ULL >> (63 - (w & 63)));
+        if (!y){
+            if (!sw--) return SIZE_MAX;
+            size_t tw = sw >> 6;
+            uint64_t z = bm_ld(&top[tw]) & (~0ULL >> (63 - (sw & 63)));
+            while (!z){
+                if (!tw--) return SIZE_MAX;
+                z = bm_ld(&top[tw]);
+            }
+            sw = tw * 64 + HI(z);
+            y = bm_ld(&sum[sw]);
+        }
+        w = sw * 64 + HI(y);
+        x = bm_ld(&m[w]);
+    }
+    return (w * 64 + HI(x)) * ARENA_GRAN;
+}
+// first block start above offset off, len if none
+static size_t bm_next(const uint64_t *m, size_t len, size_t off){
+    const uint64_t *sum = m + BMAP_WORDS(len), *top = sum + BSUM_WORDS(len);
+    size_t i = off / ARENA_GRAN + 1, w = i >> 6;
+    if (w >= BMAP_WORDS(len)) return len;
+    uint64_t x = bm_ld(&m[w]) & (~0ULL << (i & 63));
+    if (!x){
+        if (++w >= BMAP_WORDS(len)) return len;
+        size_t sw = w >> 6;
+        uint64_t y = bm_ld(&sum[sw]) & (~0ULL << (w & 63));
+        if (!y){
+            if (++sw >= BSUM_WORDS(len)) return len;
+            size_t tw = sw >> 6;
+            uint64_t z = bm_ld(&top[tw]) & (~0ULL << (sw & 63));
+            while (!z){
+                if (++tw >= BTOP_WORDS(len)) return len;
+                z = bm_ld(&top[tw]);
+            }
+            sw = tw * 64 + LO(z);
+            y = bm_ld(&sum[sw]);
+        }
+        w = sw * 64 + LO(y);
+        x = bm_ld(&m[w]);
+    }
+    size_t r = (w * 64 + LO(x)) * ARENA_GRAN;
+    return r < len ? r : len;
+}
+#undef HI
+#undef LO
+#define HBIT_SET(h,b) bm_set((h)->bmap, HEAP_RESERVE, (size_t)((char*)(b) - (char*)(h)->heap0))
+#define HBIT_CLR(h,b) bm_clr((h)->bmap, HEAP_RESERVE, (size_t)((char*)(b) - (char*)(h)->heap0))
+#define BBIT_SET(b)   bm_set(b_bmap, BUD_SIZE, (size_t)((char*)(b) - (char*)b_arena))
+#define BBIT_CLR(b)   bm_clr(b_bmap, BUD_SIZE, (size_t)((char*)(b) - (char*)b_arena))
+#define BBIT_HAS(b)   bm_has(b_bmap, BUD_SIZE, (size_t)((char*)(b) - (char*)b_arena))
+
+// bytes of h currently managed (committed and carved into blocks)
+static inline size_t hlen(const heap_t *h){
+    return (size_t)((char*)h->heap0_end - (char*)h->heap0);
+}
+// where the block starting at off ends
+static inline size_t heap_next(const heap_t *h, size_t off){
+    size_t e = bm_next(h->bmap, HEAP_RESERVE, off);
+    return e < hlen(h) ? e : hlen(h);
+}
+// payload ptr -> its header, or NULL if no block starts there
+static free_blk_t* heap_hdr(heap_t *h, void *ptr){
+    uintptr_t off = (uintptr_t)ptr - HDRSZ - (uintptr_t)h->heap0;
+    return bm_has(h->bmap, hlen(h), off) ? (free_blk_t*)((char*)ptr - HDRSZ) : NULL;
+}
+// heap_hdr without h->lk: the arena and bitmap sit at fixed spots in the
+// shard mapping, so neither heap0_end nor inited (both written under the
+// lock as the heap grows or is reset) is read; no bit past hlen is ever set
+static free_blk_t* heap_hdr_unlocked(heap_t *h, void *ptr){
+    size_t i = (size_t)(h - shards);
+    char *heap0 = shard_base + i * HEAP_RESERVE;
+    const uint64_t *bmap = (const uint64_t*)(shard_base + (size_t)NSHARD * HEAP_RESERVE +
+                                             i * BMAP_BYTES(HEAP_RESERVE));
+    uintptr_t off = (uintptr_t)ptr - HDRSZ - (uintptr_t)heap0;
+    return bm_has(bmap, HEAP_RESERVE, off) ? (free_blk_t*)((char*)ptr - HDRSZ) : NULL;
+}
+static bud_t* bud_hdr(void *ptr){
+    uintptr_t off = (uintptr_t)ptr - BUDHDR - (uintptr_t)b_arena;
+    return bm_has(b_bmap, BUD_SIZE, off) ? (bud_t*)((char*)ptr - BUDHDR) : NULL;
+}
+
+/* Level PRNG
+ * Each shard owns its generator (h->prng, on the shard's own cache lines)
+ * and only ever steps it while holding h->lk, which sidx_insert's callers
+ * already do. So no shared mutable state, no atomics, and a shard's level
+ * sequence depends only on what happened in that shard. A range allocator
+ * keeps its own the same way, under its own lock.
+ * Shard i starts from prng_seed stepped by i golden-ratio increments
+ * (shard 0 gets the seed itself).
+ */
+#define PRNG_SEED 0x9E3779B9U             // golden ratio seed 
+static uint32_t prng_seed = PRNG_SEED;   // written with every shard lock held
+
+static uint32_t shard_seed(int i){
+    uint32_t x = prng_seed + (uint32_t)i * PRNG_SEED;
+    return x ? x : PRNG_SEED;            // xorshift dies on 0
+}
+static inline uint32_t xr(uint32_t *s){
+    uint32_t x = *s;
     x ^= x << 13; x ^= x >> 17; x ^= x << 5;
-    prng_state = x ? x : 0xA5A5A5A5U;
-    return prng_state;
+    *s = x ? x : 0xA5A5A5A5U;
+    return *s;
 }
-static int rand_lvl(void){
+static int rand_lvl(uint32_t *s){
     // geometric p=1/2, capped at SKLVL 
-    int h = 1;
-    while (h < SKLVL && (xr() & 1U)) h++;
-    return h;
+    int lv = 1;
+    while (lv < SKLVL && (xr(s) & 1U)) lv++;
+    return lv;
 }
-static inline int cmp_size_addr(free_blk_t *a, free_blk_t *b){
-    if (a->sz < b->sz) return -1;
-    if (a->sz > b->sz) return  1;
-    uintptr_t aa = (uintptr_t)a, bb = (uintptr_t)b;
-    return (aa < bb) ? -1 : (aa > bb) ? 1 : 0;
+/* Address levels (optional): level = 1 + trailing zeros of a hash of the
+ * block's offset in its shard. Still geometric p=1/2, but a block at a
+ * given offset always gets the same height, so the index shape is a pure
+ * function of which blocks are free, whatever order got us there, and
+ * insert never touches the PRNG.
+ */
+static _Atomic int level_mode = ALLOC_LEVELS_RANDOM;
+
+static int hash_lvl(uint64_t x){
+    x += 0x9E3779B97F4A7C15ULL;                         // splitmix64 finalizer
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    x ^= x >> 31;
+    int lv = 1;
+    while (lv < SKLVL && (x & 1U)){ lv++; x >>= 1; }
+    return lv;
 }
-static inline int adjacent(free_blk_t *a, free_blk_t *b){
-    return ((char*)a + HDRSZ + a->sz) == (char*)b;
+// height for a node at offset off, by the current level mode
+static int pick_lvl(uint32_t *prng, uint64_t off){
+    return atomic_load_explicit(&level_mode, memory_order_relaxed) == ALLOC_LEVELS_ADDRESS
+         ? hash_lvl(off) : rand_lvl(prng);
 }
-static void alu(free_blk_t *n){
-    if (n->aprev) n->aprev->anext = n->anext; else alist_head = n->anext;
-    if (n->anext) n->anext->aprev = n->aprev;
-    n->aprev = n->anext = NULL;
+
+/* Skip list (size index)
+ * Ordered by (key, node address), so equal keys keep a fixed order and
+ * removing one exact node is a plain search. Used by the fit heap (nodes
+ * are free-block headers) and the range allocator (out-of-band nodes).
+ * Every op returns or adds the links it followed; callers keep the stats.
+ */
+static inline int cmp_size_addr(const sknode_t *a, const sknode_t *b){
+    if (a->key < b->key) return -1;
+    if (a->key > b->key) return  1;
+    uintptr_t aa = (uintptr_t)a, bb = (uintptr_t)b;
+    return (aa < bb) ? -1 : (aa > bb) ? 1 : 0;
 }
-static void alb(free_blk_t *prev, free_blk_t *next, free_blk_t *n){
-    n->aprev = prev; n->anext = next;
-    if (prev) prev->anext = n; else alist_head = n;
-    if (next) next->aprev = n;
+static inline void sk_reset(sknode_t *n){
+    for (int i=0;i<SKLVL;i++) n->snext[i] = NULL;
+    n->lvl = 1;
 }
-//Size-index (skip-list) ops
-static void sidx_insert(free_blk_t *n){
-    int L = n->lvl = rand_lvl();
-    free_blk_t *upd[SKLVL]; for (int i=0;i<SKLVL;i++) upd[i]=NULL;
+static uint64_t sk_insert(sklist_t *l, sknode_t *n, int L){
+    n->lvl = L;
+    sknode_t *upd[SKLVL]; for (int i=0;i<SKLVL;i++) upd[i]=NULL;
     // search the positions (>= by size,addr)
-    free_blk_t *cur = NULL;
+    sknode_t *cur = NULL;
+    uint64_t hops = 0;
     for (int i=SKLVL-1;i>=0;i--){
-        free_blk_t *p = (cur ? cur->snext[i] : sidx.head[i]);
-        while (p && cmp_size_addr(p,n) < 0){ cur=p; p=p->snext[i]; }
+        sknode_t *p = (cur ? cur->snext[i] : l->head[i]);
+        while (p && cmp_size_addr(p,n) < 0){ cur=p; p=p->snext[i]; hops++; }
         upd[i] = cur;
     }
     for (int i=0;i<L;i++){
-        free_blk_t *p = upd[i] ? upd[i]->snext[i] : sidx.head[i];
+        sknode_t *p = upd[i] ? upd[i]->snext[i] : l->head[i];
         n->snext[i] = p;
-        if (upd[i]) upd[i]->snext[i] = n; else sidx.head[i] = n;
+        if (upd[i]) upd[i]->snext[i] = n; else l->head[i] = n;
     }
     for (int i=L;i<SKLVL;i++) n->snext[i] = NULL;
+    return hops;
 }
-static void sidx_remove_exact(free_blk_t *n){
-    free_blk_t *upd[SKLVL];
-    free_blk_t *cur = NULL;
+static uint64_t sk_remove(sklist_t *l, sknode_t *n){
+    sknode_t *upd[SKLVL];
+    sknode_t *cur = NULL;
+    uint64_t hops = 0;
     for (int i=SKLVL-1;i>=0;i--){
-        free_blk_t *p = (cur ? cur->snext[i] : sidx.head[i]);
-        while (p && cmp_size_addr(p,n) < 0){ cur=p; p=p->snext[i]; }
+        sknode_t *p = (cur ? cur->snext[i] : l->head[i]);
+        while (p && cmp_size_addr(p,n) < 0){ cur=p; p=p->snext[i]; hops++; }
         upd[i] = cur;
     }
     for (int i=0;i<SKLVL;i++){
-        free_blk_t *next = upd[i] ? upd[i]->snext[i] : sidx.head[i];
+        sknode_t *next = upd[i] ? upd[i]->snext[i] : l->head[i];
         if (next == n){
             if (upd[i]) upd[i]->snext[i] = n->snext[i];
-            else        sidx.head[i]     = n->snext[i];
+            else        l->head[i]       = n->snext[i];
         }
     }
+    return hops;
 }
-// thsi is the first node with size >= need 
-static free_blk_t* sidx_ge(size_t need){
-    free_blk_t *cur = NULL;
+// thsi is the first node with key >= need 
+static sknode_t* sk_ge(const sklist_t *l, size_t need, uint64_t *hops){
+    sknode_t *cur = NULL;
     for (int i=SKLVL-1;i>=0;i--){
-        free_blk_t *p = (cur ? cur->snext[i] : sidx.head[i]);
-        while (p && p->sz < need){ cur=p; p=p->snext[i]; }
+        sknode_t *p = (cur ? cur->snext[i] : l->head[i]);
+        while (p && p->key < need){ cur=p; p=p->snext[i]; (*hops)++; }
     }
-    return cur ? cur->snext[0] : sidx.head[0];
+    return cur ? cur->snext[0] : l->head[0];
 }
 // the largest node
-static free_blk_t* sidx_max(void){
-    free_blk_t *cur =NULL;
+static sknode_t* sk_max(const sklist_t *l, uint64_t *hops){
+    sknode_t *cur =NULL;
     for (int i=SKLVL-1;i>=0;i--){
-        free_blk_t *p = (cur ? cur->snext[i] : sidx.head[i]);
-        while (p){ cur=p; p=p->snext[i]; }
+        sknode_t *p = (cur ? cur->snext[i] : l->head[i]);
+        while (p){ cur=p; p=p->snext[i]; (*hops)++; }
     }
     return cur;
 }
-static void heap_bootstrap(void){
-    if (heap0_inited) return;
 
-    void *p = mmap(NULL, HEAP_SIZE, PROT_READ|PROT_WRITE,
-                   MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
-    if (p == MAP_FAILED){ perror("mmap"); _exit(1); }
+/* Fit engine
+ * Address-ordered free list with a next-fit rover, plus the size index.
+ * The searches, carving a request out of a free node and coalescing live
+ * here once, shared by the fit heap (nodes are its in-band headers) and
+ * the range allocator (nodes come from a pool). What differs sits behind
+ * fit_ops_t: when two nodes touch, what a merge does with the node it
+ * swallows, how a carve splits, and the index hooks (level choice and
+ * stats). Ops get the list and find their owner from it.
+ */
+typedef struct fit_ops {
+    int  (*adjacent)(fitlist_t *l, free_blk_t *a, free_blk_t *b);      // a ends where b starts
+    void (*absorb)(fitlist_t *l, free_blk_t *a, free_blk_t *b);        // a grows over b
+    free_blk_t* (*split)(fitlist_t *l, free_blk_t *n, size_t need);    // leftover or NULL
+    void (*index)(fitlist_t *l, free_blk_t *n);
+    void (*unindex)(fitlist_t *l, free_blk_t *n);
+} fit_ops_t;
+
+static void fl_unlink(fitlist_t *l, free_blk_t *n){
+    if (n->aprev) n->aprev->anext = n->anext; else l->head = n->anext;
+    if (n->anext) n->anext->aprev = n->aprev;
+    n->aprev = n->anext = NULL;
+}
+static void fl_link(fitlist_t *l, free_blk_t *prev, free_blk_t *next, free_blk_t *n){
+    n->aprev = prev; n->anext = next;
+    if (prev) prev->anext = n; else l->head = n;
+    if (next) next->aprev = n;
+}
+/* The node to carve need from, NULL if none fits. Index descents add to
+ * *hops.
+ * - First-fit (O(N)): scan address list.
+ * - Next-fit (O(N)): start from rover (or head if rover not set), walk
+ *   around in circle.
+ * - Best-fit (O(log N)): smallest adequate from size index.
+ * - Worst-fit (O(log N)): largest from size index.
+ */
+static free_blk_t* fl_find(fitlist_t *l, int strategy, size_t need, uint64_t *hops){
+    switch (strategy){
+    case ALLOC_STRATEGY_FIRST:
+        for (free_blk_t *n = l->head; n; n = n->anext) if (n->sz >= need) return n;
+        return NULL;
+    case ALLOC_STRATEGY_NEXT:{
+        if (!l->head){ l->rover = NULL; return NULL; }
+        if (!l->rover) l->rover = l->head;
+        free_blk_t *n = l->rover;
+        do{
+            if (n->sz >= need) return n;
+            n = n->anext ? n->anext : l->head;
+        }while (n != l->rover);
+        return NULL;
+    }
+    case ALLOC_STRATEGY_BEST:
+        return (free_blk_t*)sk_ge(&l->sidx, need, hops);
+    case ALLOC_STRATEGY_WORST:{
+        free_blk_t *n = (free_blk_t*)sk_max(&l->sidx, hops);
+        return n && n->sz >= need ? n : NULL;
+    }
+    default:
+        return NULL;
+    }
+}
+/* Take n off the free side and split need off its front; the leftover
+ * (if any) is linked and indexed in n's place and returned. With move
+ * (first/next fit) the rover goes to the leftover, else the next node
+ * (wrap to head); otherwise it only moves if it was on n, so it never
+ * points at a node that is not free. Empty list: rover = NULL.
+ */
+static free_blk_t* fl_carve(fitlist_t *l, const fit_ops_t *o, free_blk_t *n, size_t need, int move){
+    free_blk_t *prev = n->aprev, *next = n->anext;
+    fl_unlink(l, n);
+    o->unindex(l, n);
+    free_blk_t *rem = o->split(l, n, need);
+    if (rem){ fl_link(l, prev, next, rem); o->index(l, rem); }
+    if (move || l->rover == n) l->rover = rem ? rem : (next ? next : l->head);
+    return rem;
+}
+/* Coalesce after we put a node back (linked and indexed)
+ * Try to join b with left and/or right neighbor if they touch it.
+ * After merge, put the new bigger node back into size index.
+ * If rover was pointing to b or its neighbor, move rover to the merged node.
+ */
+static free_blk_t* fl_merge(fitlist_t *l, const fit_ops_t *o, free_blk_t *b){
+    free_blk_t *p = b->aprev, *n = b->anext;
+    int merge_prev = (p && o->adjacent(l, p, b));
+    int merge_next = (n && o->adjacent(l, b, n));
+    if (merge_prev || merge_next){
+        if (merge_prev) o->unindex(l, p);
+        o->unindex(l, b);
+        if (merge_next) o->unindex(l, n);
+        if (merge_prev){
+            p->anext = b->anext;
+            if (b->anext) b->anext->aprev = p;
+            o->absorb(l, p, b);
+            if (l->rover == b || l->rover == p) l->rover = p;
+            b = p;
+        }
+        if (merge_next){
+            free_blk_t *nn = n->anext;
+            b->anext = nn; if (nn) nn->aprev = b;
+            o->absorb(l, b, n);
+            if (l->rover == n || l->rover == b) l->rover = b;
+        }
+        o->index(l, b);
+    }
+    if (!l->head) l->rover = NULL;   // safety to avoid dangling rover
+    return b;
+}
+
+static inline int adjacent(free_blk_t *a, free_blk_t *b){
+    return ((char*)a + HDRSZ + a->sz) == (char*)b;
+}
 
-    heap0 = p; heap0_end = (char*)p + HEAP_SIZE;
-    for (int i=0;i<SKLVL;i++) sidx.head[i] = NULL;
+//Size-index (skip-list) ops
+static void sidx_insert_lvl(heap_t *h, free_blk_t *n, int L){
+    uint64_t hops = sk_insert(&h->fl.sidx, &n->sk, L);
+    h->st.free_blocks++; h->st.free_bytes += n->sz;
+    h->st.idx_searches++; h->st.idx_hops += hops;
+}
+static void sidx_insert(heap_t *h, free_blk_t *n){
+    sidx_insert_lvl(h, n, pick_lvl(&h->prng, (uint64_t)((char*)n - (char*)h->heap0) >> 3));
+}
+static void sidx_remove_exact(heap_t *h, free_blk_t *n){
+    uint64_t hops = sk_remove(&h->fl.sidx, &n->sk);
+    h->st.free_blocks--; h->st.free_bytes -= n->sz;
+    h->st.idx_searches++; h->st.idx_hops += hops;
+}
+// one mapping for all shard arenas, done once by whoever gets here first
+static int shard_map(void){
+    lk_take(&shard_map_lk);
+    if (!shard_mapped){
+        size_t arenas = (size_t)NSHARD * HEAP_RESERVE;
+        size_t len = arenas + (size_t)NSHARD * BMAP_BYTES(HEAP_RESERVE);
+        void *p = mmap(NULL, len, PROT_NONE,
+                       MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+        // bitmaps are RW from the start, untouched pages of them cost nothing
+        if (p != MAP_FAILED &&
+            mprotect((char*)p + arenas, len - arenas, PROT_READ|PROT_WRITE) != 0){
+            munmap(p, len);
+            p = MAP_FAILED;
+        }
+        if (p != MAP_FAILED){
+            shard_base = p;
+            shard_mapped = 1;
+            PROBE2(arena__map, p, len);
+            HOOK(allocator_on_arena_map, p, len);
+        }else DBG("mmap(heap) failed\n");
+    }
+    lk_drop(&shard_map_lk);
+    return shard_mapped ? 0 : -1;
+}
+// make the first len bytes of h usable (grows only); called with h->lk held
+static int heap_commit(heap_t *h, size_t len){
+    size_t pg = sys_page();
+    size_t want = (len + pg - 1) & ~(pg - 1);
+    if (want > HEAP_RESERVE) want = HEAP_RESERVE;
+    if (want <= h->commit) return 0;
+    if (mprotect((char*)h->heap0 + h->commit, want - h->commit, PROT_READ|PROT_WRITE) != 0){
+        DBG("mprotect(commit) failed\n");
+        return -1;
+    }
+    h->commit = want;
+    return 0;
+}
+// hand everything past the first len bytes back to the kernel
+static void heap_decommit(heap_t *h, size_t len){
+    size_t pg = sys_page();
+    size_t keep = (len + pg - 1) & ~(pg - 1);
+    if (keep >= h->commit) return;
+    char *p = (char*)h->heap0 + keep;
+    madvise(p, h->commit - keep, MADV_DONTNEED);
+    mprotect(p, h->commit - keep, PROT_NONE);
+    h->commit = keep;
+}
+// called with h->lk held; -1 if the arena could not be mapped
+static int heap_bootstrap(heap_t *h){
+    if (h->inited) return 0;
+    if (!shard_mapped && shard_map() < 0) return -1;
+
+    char *p = shard_base + (size_t)(h - shards) * HEAP_RESERVE;
+    size_t old = h->heap0 ? hlen(h) : 0;     // bits of a previous life
+    h->heap0 = p;
+    h->bmap = (uint64_t*)(shard_base + (size_t)NSHARD * HEAP_RESERVE +
+                          (size_t)(h - shards) * BMAP_BYTES(HEAP_RESERVE));
+    memset(h->bmap, 0, BMAP_WORDS(old) * 8);
+    memset(h->bmap + BMAP_WORDS(HEAP_RESERVE), 0, BSUM_WORDS(old) * 8);
+    memset(h->bmap + BMAP_WORDS(HEAP_RESERVE) + BSUM_WORDS(HEAP_RESERVE), 0,
+           BTOP_WORDS(old) * 8);
+    heap_decommit(h, HEAP_SIZE);
+    if (heap_commit(h, HEAP_SIZE) < 0) return -1;
+    h->heap0_end = p + HEAP_SIZE;
+    h->fl.sidx = (sklist_t){0};
+    memset(&h->st, 0, sizeof h->st);
+    h->prng = shard_seed((int)(h - shards));
+    atomic_store_explicit(&h->pending, NULL, memory_order_relaxed);
 
     //. first (whole) free block 
     free_blk_t *b = (free_blk_t*)p;
+    UNPOISON_META(b, HDRSZ);
     b->sz = HEAP_SIZE - HDRSZ;
     b->anext = b->aprev = NULL;
-    for (int i=0;i<SKLVL;i++) b->snext[i]=NULL;
-    b->lvl = 1;
+    sk_reset(&b->sk);
     b->magic = MAGIC_F; b->is_free = 1;
 
-    alist_head = b;
-    sidx_insert(b);
-    rover = b;                         
-    prng_state = 0x9E3779B9U;        
+    POISON((char*)b + HDRSZ, b->sz);
+    HBIT_SET(h, b);
+    h->fl.head = b;
+    // the only block: full height, no need to spend a PRNG draw on it
+    sidx_insert_lvl(h, b, SKLVL);
+    h->fl.rover = b;                         
 
-    heap0_inited = 1;
+    h->inited = 1;
+    return 0;
 }
 
 /* 
@@ -208,175 +883,724 @@ static void heap_bootstrap(void){
  * Else not worth it: return NULL and give full block to user,
  * so we don’t leave tiny useless piece in free list.
  */
-static free_blk_t* smt(free_blk_t *blk, size_t need){
+static free_blk_t* smt(heap_t *h, free_blk_t *blk, size_t need){
     size_t total  = HDRSZ + blk->sz;
     size_t needed = HDRSZ + need;
     if (total >= needed + HDRSZ + MIN_TAIL){
         free_blk_t *rem = (free_blk_t*)((char*)blk + needed);
+        UNPOISON_META(rem, HDRSZ);       // was inside blk's payload
         rem->sz = total - needed - HDRSZ;
         rem->anext = rem->aprev = NULL;
-        for (int i=0;i<SKLVL;i++) rem->snext[i] = NULL;
-        rem->lvl = 1;
+        sk_reset(&rem->sk);
         rem->magic = MAGIC_F; rem->is_free = 1;
+        HBIT_SET(h, rem);
 
         blk->sz = need;
+        h->st.splits++;
+        PROBE3(split, (int)(h - shards), need, rem->sz);
         return rem;
     }
     return NULL;
 }
 
-/* Coalesce after we put a block back 
- * Try to join b with left and/or right neighbor if they sit next to it in mem.
- * After merge, put the new bigger block back into size index.
- * If rover was pointing to b or its neighbor, move rover to the merged block.
+/* Fit heap side of the engine: headers touch when one ends where the next
+ * begins, a swallowed header becomes payload, leftovers come from smt().
  */
+#define HEAP_OF(l) ((heap_t*)((char*)(l) - offsetof(heap_t, fl)))
 
-static free_blk_t* cola(free_blk_t *b){
-    free_blk_t *p = b->aprev, *n = b->anext;
-    int merge_prev = (p && adjacent(p,b));
-    int merge_next = (n && adjacent(b,n));
-    if (!merge_prev && !merge_next) goto done;
-    if (merge_prev) sidx_remove_exact(p);
-    sidx_remove_exact(b);
-    if (merge_next) sidx_remove_exact(n);
-    if (merge_prev){
-        p->anext = b->anext;
-        if (b->anext) b->anext->aprev = p;
-        p->sz += HDRSZ + b->sz;
-        if (rover == b || rover == p) rover = p;
-        b = p;
-    }
-    if (merge_next){
-        free_blk_t *nn = n->anext;
-        b->anext = nn; if (nn) nn->aprev = b;
-        b->sz += HDRSZ + n->sz;
-        if (rover == n || rover == b) rover = b;
-    }
-    sidx_insert(b);
-
-
-done:
+static int h_adjacent(fitlist_t *l, free_blk_t *a, free_blk_t *b){
+    (void)l;
+    return adjacent(a, b);
+}
+static void h_absorb(fitlist_t *l, free_blk_t *a, free_blk_t *b){
+    heap_t *h = HEAP_OF(l);
+    a->sz += HDRSZ + b->sz;
+    HBIT_CLR(h, b);
+    h->st.merges++;
+}
+static free_blk_t* h_split(fitlist_t *l, free_blk_t *n, size_t need){ return smt(HEAP_OF(l), n, need); }
+static void h_index(fitlist_t *l, free_blk_t *n)  { sidx_insert(HEAP_OF(l), n); }
+static void h_unindex(fitlist_t *l, free_blk_t *n){ sidx_remove_exact(HEAP_OF(l), n); }
+
+static const fit_ops_t heap_ops = { h_adjacent, h_absorb, h_split, h_index, h_unindex };
+
+static free_blk_t* cola(heap_t *h, free_blk_t *b){
+    uint64_t m = h->st.merges;
+    b = fl_merge(&h->fl, &heap_ops, b);
+    if (h->st.merges != m) PROBE3(merge, (int)(h - shards), b->sz, (int)(h->st.merges - m));
 #ifdef MMU_DEBUG
-    for (free_blk_t *q = alist_head; q && q->anext; q = q->anext){
+    for (free_blk_t *q = h->fl.head; q && q->anext; q = q->anext){
         assert((uintptr_t)q < (uintptr_t)q->anext);
         assert(!adjacent(q, q->anext));
+        assert(bm_has(h->bmap, hlen(h), (uintptr_t)((char*)q->anext - (char*)h->heap0)));
     }
 #endif
-    if (!alist_head) rover = NULL;   // safety to avoid dangling rover
     return b;
 }
-// important part 
-// First-fit (O(N)): scan address list, split if helpful, re-index remainder
-void* malloc_first_fit(size_t size){
-    if (!size) return NULL;
-    if (!heap0_inited) heap_bootstrap();
-    current_strategy = ALLOC_STRATEGY_FIRST;
-
-    for (free_blk_t *cur = alist_head; cur; cur = cur->anext){
-        if (cur->sz >= size){
-            free_blk_t *prev = cur->aprev, *next = cur->anext;
-            alu(cur);
-            sidx_remove_exact(cur);
-
-            free_blk_t *rem = smt(cur, size);
-            if (rem){
-                alb(prev, next, rem);
-                sidx_insert(rem);
-                rover = rem;
-            }else{
-                rover = next ? next : alist_head;
-            }
-            cur->is_free = 0; cur->magic = MAGIC_A;
+// important part: one body for the four fits, the engine does the search
+// and the split, the heap seals the block it got
+static void* heap_fit(heap_t *h, int strategy, size_t size){
+    uint64_t hops = 0;
+    free_blk_t *b = fl_find(&h->fl, strategy, size, &hops);
+    if (strategy >= ALLOC_STRATEGY_BEST){ h->st.idx_searches++; h->st.idx_hops += hops; }
+    if (!b) return NULL;
+    (void)fl_carve(&h->fl, &heap_ops, b, size, strategy <= ALLOC_STRATEGY_NEXT);
+    b->is_free = 0; b->magic = MAGIC_A;
 #ifdef MMU_DEBUG
-            for (free_blk_t *q = alist_head; q && q->anext; q=q->anext)
-                assert((uintptr_t)q < (uintptr_t)q->anext);
+    for (free_blk_t *q = h->fl.head; q && q->anext; q=q->anext)
+        assert((uintptr_t)q < (uintptr_t)q->anext);
 #endif
-            return (char*)cur + HDRSZ;
+    return (char*)b + HDRSZ;
+}
+static void* first_fit(heap_t *h, size_t size){ return heap_fit(h, ALLOC_STRATEGY_FIRST, size); }
+static void* next_fit(heap_t *h, size_t size) { return heap_fit(h, ALLOC_STRATEGY_NEXT,  size); }
+static void* best_fit(heap_t *h, size_t size) { return heap_fit(h, ALLOC_STRATEGY_BEST,  size); }
+static void* worst_fit(heap_t *h, size_t size){ return heap_fit(h, ALLOC_STRATEGY_WORST, size); }
+/* Pointer maps
+ * Fixed tables for bookkeeping that has no header to live in (guarded
+ * pages, sampled call sites): open addressing on a nonzero key, linear
+ * probing, backward-shift delete so no tombstones pile up. Kept at most
+ * 3/4 full; callers hold whatever lock guards the map.
+ */
+typedef struct {
+    uintptr_t key;                       // 0 = empty slot
+    void     *val;
+} pent_t;
+
+typedef struct {
+    pent_t *e;
+    size_t  cap;                         // power of two
+    size_t  n;
+} pmap_t;
+
+static inline size_t pm_slot(const pmap_t *m, uintptr_t key){
+    return (size_t)((uint64_t)key * 0x9E3779B97F4A7C15ULL >> 32) & (m->cap - 1);
+}
+static inline int pm_room(const pmap_t *m, size_t k){
+    return m->n + k <= m->cap / 4 * 3;
+}
+static pent_t* pm_get(pmap_t *m, uintptr_t key){
+    size_t i = pm_slot(m, key);
+    while (m->e[i].key && m->e[i].key != key) i = (i + 1) & (m->cap - 1);
+    return m->e[i].key ? &m->e[i] : NULL;
+}
+// caller checked pm_room
+static void pm_put(pmap_t *m, uintptr_t key, void *val){
+    size_t i = pm_slot(m, key);
+    while (m->e[i].key) i = (i + 1) & (m->cap - 1);
+    m->e[i].key = key; m->e[i].val = val;
+    m->n++;
+}
+static void pm_del(pmap_t *m, pent_t *e){
+    size_t i = (size_t)(e - m->e), c = m->cap - 1;
+    // pull later members of the probe run back over the hole
+    for (size_t j = (i + 1) & c; m->e[j].key; j = (j + 1) & c){
+        size_t k = pm_slot(m, m->e[j].key);
+        if (((j - k) & c) >= ((j - i) & c)){
+            m->e[i] = m->e[j]; i = j;
         }
     }
-    return NULL;
+    m->e[i].key = 0; m->e[i].val = NULL;
+    m->n--;
 }
-/* Next-fit (O(N)):
- * - Start from rover (or head if rover not set), walk around in circle.
- * - If we split a block, set rover = leftover part; else rover = next (wrap to head).
- * - If free list become empty (rare), set rover = NULL so it not point garbage.
-*/
-void* malloc_next_fit(size_t size){
+
+/* Mapping cache
+ * Private mappings we give back (guarded blocks) are parked here instead of
+ * munmapped: the contents are dropped with MADV_FREE, the range stays. The
+ * next request that fits takes one back without a syscall pair, so an
+ * alloc/free sawtooth stops paying mmap + munmap per block. Bounded by slot
+ * count and by bytes (mapc_cap, 0 = off); the oldest entry goes first.
+ * A guarded entry keeps its PROT_NONE last page, so it only serves guarded
+ * requests, and only up to a quarter bigger than asked (the rest is slack
+ * in front of the payload, never touched).
+ */
+#define MAPC_SLOTS 64
+#define MAPC_CAP   ((size_t)4 << 20)     // default byte budget
+
+typedef struct {
+    char  *base;
+    size_t len;
+    int    guarded;
+} mapc_t;
+
+static mapc_t mapc[MAPC_SLOTS];          // oldest first
+static size_t mapc_n, mapc_bytes;
+static _Atomic size_t mapc_cap = MAPC_CAP;
+static lk_t   mapc_lk;                   // guards mapc + mapc_n + mapc_bytes
+static _Atomic unsigned long long map_calls, unmap_calls, remap_calls, mapc_hits, mapc_parks;
+
+#ifdef MADV_FREE
+  #define MAPC_ADVICE MADV_FREE
+#else
+  #define MAPC_ADVICE MADV_DONTNEED      // pre-4.5 headers
+#endif
+
+static void map_drop(char *base, size_t len){
+    munmap(base, len);
+    atomic_fetch_add_explicit(&unmap_calls, 1, memory_order_relaxed);
+    PROBE2(arena__unmap, base, len);
+    HOOK(allocator_on_arena_unmap, base, len);
+}
+
+// a fresh or cached mapping of at least len bytes (*got = real length)
+static char* map_get(size_t len, int guarded, size_t *got){
+    char *base = NULL;
+    lk_take(&mapc_lk);
+    size_t best = mapc_n;
+    for (size_t i = 0; i < mapc_n; ++i){
+        if (mapc[i].guarded != guarded) continue;
+        if (mapc[i].len < len || mapc[i].len > len + len / 4) continue;
+        if (best == mapc_n || mapc[i].len < mapc[best].len) best = i;
+    }
+    if (best < mapc_n){
+        base = mapc[best].base; *got = mapc[best].len;
+        mapc_bytes -= *got;
+        memmove(&mapc[best], &mapc[best + 1], (mapc_n - best - 1) * sizeof mapc[0]);
+        mapc_n--;
+    }
+    lk_drop(&mapc_lk);
+    if (base){
+        atomic_fetch_add_explicit(&mapc_hits, 1, memory_order_relaxed);
+        return base;
+    }
+    base = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) return NULL;
+    atomic_fetch_add_explicit(&map_calls, 1, memory_order_relaxed);
+    if (guarded && mprotect(base + len - page_sz, page_sz, PROT_NONE) != 0){
+        map_drop(base, len);
+        return NULL;
+    }
+    PROBE2(arena__map, base, len);
+    HOOK(allocator_on_arena_map, base, len);
+    *got = len;
+    return base;
+}
+
+// keep the mapping for reuse if it fits the budget, evicting old ones
+static void map_put(char *base, size_t len, int guarded){
+    size_t cap = atomic_load_explicit(&mapc_cap, memory_order_relaxed);
+    if (len > cap){ map_drop(base, len); return; }
+    madvise(base, len - (guarded ? page_sz : 0), MAPC_ADVICE);
+    mapc_t out[MAPC_SLOTS];
+    size_t nout = 0;
+    lk_take(&mapc_lk);
+    while (mapc_n && (mapc_n == MAPC_SLOTS || mapc_bytes + len > cap)){
+        out[nout++] = mapc[0];
+        mapc_bytes -= mapc[0].len;
+        memmove(&mapc[0], &mapc[1], (mapc_n - 1) * sizeof mapc[0]);
+        mapc_n--;
+    }
+    mapc[mapc_n++] = (mapc_t){ base, len, guarded };
+    mapc_bytes += len;
+    lk_drop(&mapc_lk);
+    atomic_fetch_add_explicit(&mapc_parks, 1, memory_order_relaxed);
+    for (size_t i = 0; i < nout; ++i) map_drop(out[i].base, out[i].len);
+}
+
+// unmap everything parked
+static void map_flush(void){
+    mapc_t out[MAPC_SLOTS];
+    lk_take(&mapc_lk);
+    size_t nout = mapc_n;
+    memcpy(out, mapc, nout * sizeof mapc[0]);
+    mapc_n = 0; mapc_bytes = 0;
+    lk_drop(&mapc_lk);
+    for (size_t i = 0; i < nout; ++i) map_drop(out[i].base, out[i].len);
+}
+
+/* Guard pages (debug, opt-in)
+ * A picked allocation gets its own mapping: payload pushed up against the
+ * end of the last RW page, followed by one PROT_NONE page, so the first
+ * byte written past the end faults right at the bad store. The picking is
+ * per strategy: every_n = 0 off, 1 always, N = one in N calls (a per-thread
+ * countdown, no shared counter on the hot path). Payload is kept 8 byte
+ * aligned, so an overflow into those few slack bytes is not caught.
+ * If the mapping fails we just fall back to the normal heap.
+ */
+#define GUARD_ALIGN 8
+
+typedef struct {
+    void    *base;                       // mapping start
+    size_t   len;                        // mapping length, guard page included
+    size_t   sz;                         // what the user asked for
+    uint32_t magic;
+} ghdr_t;
+
+#define GHDR ((size_t)sizeof(ghdr_t))
+
+static _Atomic unsigned guard_every[ALLOC_STRATEGY_FIB + 1];
+static _Atomic size_t guard_live = 0;    // my_free only looks for guards if > 0
+static _Thread_local unsigned guard_tick[ALLOC_STRATEGY_FIB + 1];
+
+/* Live guarded mappings, one entry per RW page (key = page address, value
+ * = the payload living there). Keying by page lets an interior pointer
+ * find its block too: round down, one probe. When the map is full
+ * guard_alloc just says no and the heap serves the call. Sizes the arena
+ * could not serve are never guarded, so sampling does not change which
+ * sizes can succeed.
+ */
+#define GUARD_TAB 1024
+
+static pent_t guard_ents[GUARD_TAB];
+static pmap_t guard_map = { guard_ents, GUARD_TAB, 0 };
+static lk_t   guard_lk;                  // guards guard_map
+
+static int guard_add(char *base, size_t data, char *user){
+    size_t np = data / page_sz;
+    lk_take(&guard_lk);
+    int ok = pm_room(&guard_map, np);
+    for (size_t k = 0; ok && k < np; k++)
+        pm_put(&guard_map, (uintptr_t)base + k * page_sz, user);
+    lk_drop(&guard_lk);
+    return ok;
+}
+static inline uintptr_t page_of(const void *p){
+    return (uintptr_t)p & ~(uintptr_t)(page_sz - 1);
+}
+// 1 if p was a registered payload start (and no longer is)
+static int guard_del(void *p){
+    lk_take(&guard_lk);
+    pent_t *e = pm_get(&guard_map, page_of(p));
+    int hit = e && e->val == p;
+    if (hit){
+        ghdr_t *g = (ghdr_t*)((char*)p - GHDR);
+        for (char *pg = g->base; pg < (char*)g->base + g->len - page_sz; pg += page_sz)
+            pm_del(&guard_map, pm_get(&guard_map, (uintptr_t)pg));
+    }
+    lk_drop(&guard_lk);
+    return hit;
+}
+// payload of the guarded block covering p, NULL if none
+static char* guard_find(const void *p){
+    if (!atomic_load_explicit(&guard_live, memory_order_relaxed)) return NULL;
+    lk_take(&guard_lk);
+    pent_t *e = pm_get(&guard_map, page_of(p));
+    char *u = e ? e->val : NULL;
+    if (u && ((const char*)p < u ||
+              (const char*)p >= u + ((ghdr_t*)(u - GHDR))->sz)) u = NULL;
+    lk_drop(&guard_lk);
+    return u;
+}
+static int guard_pick(int strategy){
+    unsigned n = atomic_load_explicit(&guard_every[strategy], memory_order_relaxed);
+    if (!n) return 0;
+    if (++guard_tick[strategy] < n) return 0;
+    guard_tick[strategy] = 0;
+    return 1;
+}
+static void* guard_alloc(size_t size){
+    (void)sys_page();
+    if (size > SIZE_MAX - GHDR - GUARD_ALIGN - 2 * page_sz) return NULL;  // rounding would wrap
+    size_t asz  = (size + GUARD_ALIGN - 1) & ~(size_t)(GUARD_ALIGN - 1);
+    size_t data = (asz + GHDR + page_sz - 1) & ~(page_sz - 1);
+    size_t len;
+    char *base = map_get(data + page_sz, 1, &len);
+    if (!base) return NULL;
+    data = len - page_sz;                // a cached mapping may be a bit longer
+    char *user = base + data - asz;
+    ghdr_t *g = (ghdr_t*)(user - GHDR);
+    g->base = base; g->len = len; g->sz = size;
+    g->magic = MAGIC_G;
+    if (!guard_add(base, data, user)){
+        map_put(base, len, 1);
+        return NULL;
+    }
+    atomic_fetch_add_explicit(&guard_live, 1, memory_order_relaxed);
+    return user;
+}
+// 1 if ptr was a guarded allocation (and is gone now)
+static int guard_free(void *ptr){
+    if (!atomic_load_explicit(&guard_live, memory_order_relaxed)) return 0;
+    if (!guard_del(ptr)) return 0;       // not one of ours, header never read
+    ghdr_t *g = (ghdr_t*)((char*)ptr - GHDR);
+    g->magic = MAGIC_F;
+    atomic_fetch_sub_explicit(&guard_live, 1, memory_order_relaxed);
+    map_put(g->base, g->len, 1);
+    return 1;
+}
+void allocator_set_guard_sampling(allocator_strategy_t strategy, unsigned every_n){
+    if (strategy < ALLOC_STRATEGY_FIRST || strategy > ALLOC_STRATEGY_FIB) return;
+    atomic_store_explicit(&guard_every[strategy], every_n, memory_order_relaxed);
+}
+
+/* Large blocks (opt-in)
+ * Fit requests of at least large_min bytes (0 = off) skip the shards and
+ * get a mapping of their own (through the mapping cache), with a small
+ * header on the first page and the payload right after it. They are
+ * found by payload in large_map. my_realloc resizes them with mremap:
+ * the kernel moves page tables, so growing a multi-megabyte buffer costs
+ * O(pages), not a copy. large_lk is held across that mremap.
+ */
+#define LARGE_TAB 256
+#define LHDR      ((size_t)32)           // keeps the payload 16 byte aligned
+
+typedef struct {
+    size_t   len;                        // mapping length
+    size_t   sz;                         // what the user asked for
+    uint32_t magic;
+    int      strategy;
+} lhdr_t;
+_Static_assert(sizeof(lhdr_t) <= LHDR, "large header outgrew LHDR");
+
+static _Atomic size_t large_min = 0;
+static _Atomic size_t large_live = 0;    // my_free only looks for large ones if > 0
+
+static pent_t large_ents[LARGE_TAB];
+static pmap_t large_map = { large_ents, LARGE_TAB, 0 };
+static lk_t   large_lk;                  // guards large_map
+
+static void* large_alloc(size_t size, int strategy){
+    (void)sys_page();
+    if (size > SIZE_MAX - LHDR - page_sz) return NULL;
+    size_t len = (size + LHDR + page_sz - 1) & ~(page_sz - 1);
+    char *base = map_get(len, 0, &len);
+    if (!base) return NULL;
+    lhdr_t *l = (lhdr_t*)base;
+    l->len = len; l->sz = size; l->strategy = strategy;
+    l->magic = MAGIC_L;
+    lk_take(&large_lk);
+    int ok = pm_room(&large_map, 1);
+    if (ok) pm_put(&large_map, (uintptr_t)(base + LHDR), l);
+    lk_drop(&large_lk);
+    if (!ok){
+        map_put(base, len, 0);
+        return NULL;
+    }
+    atomic_fetch_add_explicit(&large_live, 1, memory_order_relaxed);
+    return base + LHDR;
+}
+// 1 if ptr was a large block (and is gone now)
+static int large_free(void *ptr){
+    if (!atomic_load_explicit(&large_live, memory_order_relaxed)) return 0;
+    lk_take(&large_lk);
+    pent_t *e = pm_get(&large_map, (uintptr_t)ptr);
+    lhdr_t *l = e ? e->val : NULL;
+    if (e) pm_del(&large_map, e);
+    lk_drop(&large_lk);
+    if (!l) return 0;
+    l->magic = MAGIC_F;
+    atomic_fetch_sub_explicit(&large_live, 1, memory_order_relaxed);
+    map_put((char*)l, l->len, 0);
+    return 1;
+}
+// header of the large block covering p, NULL if none
+static lhdr_t* large_find(const void *p){
+    if (!atomic_load_explicit(&large_live, memory_order_relaxed)) return NULL;
+    lhdr_t *hit = NULL;
+    lk_take(&large_lk);
+    for (size_t i = 0; i < LARGE_TAB && !hit; ++i){
+        lhdr_t *l = large_ents[i].val;
+        if (large_ents[i].key && (uintptr_t)p - large_ents[i].key < l->sz) hit = l;
+    }
+    lk_drop(&large_lk);
+    return hit;
+}
+/* Resize the large block at *pp to size: 1 done (*pp may have moved),
+ * 0 not a large block, -1 the kernel said no (block untouched). Once the
+ * block is known to be large, fires alloc__entry and stores its strategy
+ * in *strategy; the caller owes the matching return. */
+static int large_resize(void **pp, size_t size, int *strategy){
+    if (!atomic_load_explicit(&large_live, memory_order_relaxed)) return 0;
+    (void)sys_page();
+    lk_take(&large_lk);
+    pent_t *e = pm_get(&large_map, (uintptr_t)*pp);
+    if (!e){ lk_drop(&large_lk); return 0; }
+    lhdr_t *l = e->val;
+    *strategy = l->strategy;
+    PROBE2(alloc__entry, l->strategy, size);
+    if (size > SIZE_MAX - LHDR - page_sz){ lk_drop(&large_lk); return -1; }
+    size_t len = (size + LHDR + page_sz - 1) & ~(page_sz - 1);
+    size_t old = l->len;
+    if (len != old){
+        void *nb = mremap(l, old, len, MREMAP_MAYMOVE);
+        if (nb == MAP_FAILED){ lk_drop(&large_lk); return -1; }
+        atomic_fetch_add_explicit(&remap_calls, 1, memory_order_relaxed);
+        PROBE2(arena__unmap, l, old);    // l itself may be gone now
+        HOOK(allocator_on_arena_unmap, l, old);
+        PROBE2(arena__map, nb, len);
+        HOOK(allocator_on_arena_map, nb, len);
+        pm_del(&large_map, e);
+        l = nb;
+        l->len = len;
+        pm_put(&large_map, (uintptr_t)l + LHDR, l);
+    }
+    l->sz = size;
+    lk_drop(&large_lk);
+    *pp = (char*)l + LHDR;
+    return 1;
+}
+void allocator_set_large_threshold(size_t bytes){
+    atomic_store_explicit(&large_min, bytes, memory_order_relaxed);
+}
+
+/* Allocation sites (opt-in sampling)
+ * One in every_n successful allocations (per-thread countdown, same as
+ * guard picking) remembers its caller's return address in site_map, keyed
+ * by payload; my_free forgets it again. Only the leak report reads it.
+ * When the map is full further samples are just not taken.
+ */
+#define SITE_TAB 4096
+#define CALLER   __builtin_return_address(0)
+
+static pent_t site_ents[SITE_TAB];
+static pmap_t site_map = { site_ents, SITE_TAB, 0 };
+static lk_t   site_lk;                   // guards site_map
+static _Atomic unsigned site_every = 0;
+static _Atomic size_t site_live = 0;     // my_free only looks if > 0
+static _Thread_local unsigned site_tick;
+
+static void* site_note(void *p, void *site){
+    unsigned n = atomic_load_explicit(&site_every, memory_order_relaxed);
+    if (!p || !n || ++site_tick < n) return p;
+    site_tick = 0;
+    lk_take(&site_lk);
+    if (pm_room(&site_map, 1)){
+        pm_put(&site_map, (uintptr_t)p, site);
+        atomic_fetch_add_explicit(&site_live, 1, memory_order_relaxed);
+    }
+    lk_drop(&site_lk);
+    return p;
+}
+static void site_drop(void *p){
+    if (!atomic_load_explicit(&site_live, memory_order_relaxed)) return;
+    lk_take(&site_lk);
+    pent_t *e = pm_get(&site_map, (uintptr_t)p);
+    if (e){
+        pm_del(&site_map, e);
+        atomic_fetch_sub_explicit(&site_live, 1, memory_order_relaxed);
+    }
+    lk_drop(&site_lk);
+}
+static void* site_of(const void *p){
+    if (!atomic_load_explicit(&site_live, memory_order_relaxed)) return NULL;
+    lk_take(&site_lk);
+    pent_t *e = pm_get(&site_map, (uintptr_t)p);
+    void *site = e ? e->val : NULL;
+    lk_drop(&site_lk);
+    return site;
+}
+void allocator_set_site_sampling(unsigned every_n){
+    atomic_store_explicit(&site_every, every_n, memory_order_relaxed);
+}
+
+/* Trace
+ * While tracing, every structural event lands in the caller's buffer:
+ * allocs with the shard and the payload offset they got, frees at the
+ * moment the block really goes back (so async frees show up where they
+ * were drained, in that order). Events are written under the lock of the
+ * heap they touch, so per-heap order is exact. Guarded blocks are skipped,
+ * they never touch a heap. Past cap, events are counted and dropped.
+ * Since every trace_note runs under a heap lock, start and stop take all
+ * of them (as allocator_set_seed does): no writer is mid-slot when the
+ * buffer is handed over or back.
+ */
+static allocator_trace_event_t *trace_buf = NULL;
+static size_t trace_cap = 0;
+static _Atomic size_t trace_len = 0;
+static _Atomic int tracing = 0;
+
+static void trace_note(int op, int strategy, int shard, size_t size, size_t off){
+    if (!atomic_load_explicit(&tracing, memory_order_acquire)) return;
+    size_t i = atomic_fetch_add_explicit(&trace_len, 1, memory_order_relaxed);
+    if (i >= trace_cap) return;
+    allocator_trace_event_t *e = &trace_buf[i];
+    e->op = (unsigned char)op; e->strategy = (unsigned char)strategy;
+    e->shard = (unsigned short)shard;
+    e->size = size; e->offset = off;
+}
+// every lock a trace_note may run under, always in this order
+static void trace_quiesce(void){
+    for (int i=0;i<NSHARD;i++) lk_take(&shards[i].lk);
+    lk_take(&bud_lk);
+    lk_take(&fib_lk);
+}
+static void trace_resume(void){
+    lk_drop(&fib_lk);
+    lk_drop(&bud_lk);
+    for (int i=NSHARD-1;i>=0;i--) lk_drop(&shards[i].lk);
+}
+void allocator_trace_start(allocator_trace_event_t *buf, size_t cap){
+    trace_quiesce();
+    trace_buf = buf; trace_cap = buf ? cap : 0;
+    atomic_store_explicit(&trace_len, 0, memory_order_relaxed);
+    atomic_store_explicit(&tracing, 1, memory_order_release);
+    trace_resume();
+}
+size_t allocator_trace_stop(void){
+    trace_quiesce();
+    atomic_store_explicit(&tracing, 0, memory_order_release);
+    size_t n = atomic_load_explicit(&trace_len, memory_order_relaxed);
+    size_t cap = trace_cap;
+    trace_resume();
+    return n < cap ? n : cap;
+}
+
+typedef void* (*fit_fn)(heap_t*, size_t);
+
+static void heap_drain(heap_t *h);
+
+/* Grow h in place by committing more of its reservation. If the block
+ * at the very end (the wilderness, found with one bitmap search) is free,
+ * it is just stretched and re-indexed: only need minus what it already
+ * has gets committed, and no new header or seam appears. Otherwise the
+ * new memory becomes one free block linked last. Called with h->lk held;
+ * -1 if that would pass heap_limit.
+ */
+static int heap_grow(heap_t *h, size_t need){
+    size_t len = hlen(h);
+    size_t lim = atomic_load_explicit(&heap_limit, memory_order_relaxed);
+    free_blk_t *top = (free_blk_t*)((char*)h->heap0 + bm_prev(h->bmap, HEAP_RESERVE, len - 1));
+    size_t have = 0;
+    if (peek_magic(&top->magic) == MAGIC_F) have = HDRSZ + top->sz;
+    else top = NULL;
+    if (need > SIZE_MAX - HDRSZ) return -1;
+    size_t want = need + HDRSZ > have ? need + HDRSZ - have : ARENA_GRAN;
+    if (lim <= len || lim - len < want) return -1;
+    size_t add = (want + HEAP_GROW - 1) / HEAP_GROW * HEAP_GROW;
+    if (add > lim - len) add = lim - len;
+    if (heap_commit(h, len + add) < 0) return -1;
+    PROBE2(heap__grow, (int)(h - shards), add);
+
+    if (top){
+        sidx_remove_exact(h, top);
+        top->sz += add;
+        h->heap0_end = (char*)h->heap0_end + add;
+        sidx_insert(h, top);
+        POISON((char*)top + HDRSZ + top->sz - add, add);
+        return 0;
+    }
+    free_blk_t *b = (free_blk_t*)h->heap0_end;
+    UNPOISON_META(b, HDRSZ);
+    b->sz = add - HDRSZ;
+    sk_reset(&b->sk);
+    b->magic = MAGIC_F; b->is_free = 1;
+    h->heap0_end = (char*)h->heap0_end + add;
+    HBIT_SET(h, b);
+    free_blk_t *t = h->fl.head;
+    while (t && t->anext) t = t->anext;
+    fl_link(&h->fl, t, NULL, b);
+    sidx_insert(h, b);
+    POISON((char*)b + HDRSZ, b->sz);
+    if (!h->fl.rover) h->fl.rover = b;
+    return 0;
+}
+
+/* Shrink h when a free leaves a big free block at the very end: the top
+ * block keeps HEAP_TRIM bytes at least, the end moves down in whole
+ * HEAP_GROW steps (never under HEAP_SIZE, nor under what allocator_warmup
+ * asked for) and what is cut goes back to the kernel. The slack kept
+ * means a free/alloc pair at the edge does not shrink and regrow every
+ * time. Called with h->lk held.
+ */
+#define HEAP_TRIM (2 * HEAP_GROW)
+static _Atomic size_t heap_floor = HEAP_SIZE;
+
+static void heap_trim(heap_t *h){
+    size_t len = hlen(h);
+    size_t low = atomic_load_explicit(&heap_floor, memory_order_relaxed);
+    if (len <= low) return;
+    free_blk_t *top = (free_blk_t*)((char*)h->heap0 + bm_prev(h->bmap, HEAP_RESERVE, len - 1));
+    if (peek_magic(&top->magic) != MAGIC_F) return;
+    size_t keep = (size_t)((char*)top - (char*)h->heap0) + HDRSZ + HEAP_TRIM;
+    if (keep < low) keep = low;
+    if (keep >= len) return;
+    size_t cut = (len - keep) / HEAP_GROW * HEAP_GROW;
+    if (!cut) return;
+    sidx_remove_exact(h, top);
+    top->sz -= cut;
+    h->heap0_end = (char*)h->heap0_end - cut;
+    sidx_insert(h, top);
+    heap_decommit(h, len - cut);
+}
+
+static void* shard_call(heap_t *h, fit_fn fn, int strategy, size_t need, size_t size){
+    lk_take(&h->lk);
+    if (!h->inited && heap_bootstrap(h) < 0){ lk_drop(&h->lk); return NULL; }
+    if (atomic_load_explicit(&h->pending, memory_order_relaxed)) heap_drain(h);
+    void *p = fn(h, need);
+    if (!p && heap_grow(h, need) == 0) p = fn(h, need);
+    if (p){
+        h->st.alloc_blocks++;
+        h->st.alloc_bytes += ((free_blk_t*)((char*)p - HDRSZ))->sz;
+        trace_note(ALLOC_TRACE_ALLOC, strategy, (int)(h - shards), size,
+                   (size_t)((char*)p - (char*)h->heap0));
+        MARK_ALLOC(p, size);
+        POISON((char*)p - HDRSZ, HDRSZ);
+    }
+    lk_drop(&h->lk);
+    return p;
+}
+/* Public fit entry points: the size check lives here, lazy init and the
+ * heap lock in shard_call, so the search routines stay lock-free and
+ * readable. */
+static void* heap_call(fit_fn fn, int strategy, size_t size){
+    PROBE2(alloc__entry, strategy, size);
     if (!size) return NULL;
-    if (!heap0_inited) heap_bootstrap();
-    current_strategy = ALLOC_STRATEGY_NEXT;
-    if (!alist_head){ rover = NULL; return NULL; }
-    if (!rover) rover = alist_head;
-    free_blk_t *start = rover, *cur = start;
+    note_strategy(strategy);
+    size_t lmin = atomic_load_explicit(&large_min, memory_order_relaxed);
+    // guard only what a shard (or a large mapping) could serve anyway
+    if ((size <= atomic_load_explicit(&heap_limit, memory_order_relaxed) - HDRSZ ||
+         (lmin && size >= lmin)) && guard_pick(strategy)){
+        void *g = guard_alloc(size);
+        if (g) return g;
+    }
+    if (lmin && size >= lmin){
+        void *l = large_alloc(size, strategy);
+        if (l) return l;
+    }
+    if (home_shard < 0)
+        home_shard = (int)(atomic_fetch_add_explicit(&shard_next, 1,
+                               memory_order_relaxed) % NSHARD);
+    size_t need = size <= SIZE_MAX - 7 ? ALIGN_UP(size) : size;
     do{
-        if (cur->sz >= size){
-            free_blk_t *prev = cur->aprev, *next = cur->anext;
-            alu(cur);
-            sidx_remove_exact(cur);
-            free_blk_t *rem = smt(cur, size);
-            if (rem){
-                alb(prev, next, rem);
-                sidx_insert(rem);
-                rover = rem;                       
-            }else{
-                rover = alist_head ? (next ? next : alist_head) : NULL;
-            }
-            if (!alist_head) rover = NULL;         // for safety clamp 
-            cur->is_free = 0; cur->magic = MAGIC_A;
-            return (char*)cur + HDRSZ;
+        // home first, then spill over to the neighbours in order
+        for (int i=0;i<NSHARD;i++){
+            void *p = shard_call(&shards[(home_shard + i) % NSHARD], fn, strategy,
+                                 need, size);
+            if (p) return p;
         }
-        cur = cur->anext ? cur->anext : alist_head; 
-    }while (cur && cur != start);
-
-    if (!alist_head) rover = NULL;               // its too difficult boi ma man
+    }while (oom_retry(size, strategy));
     return NULL;
 }
-
-// Best-fit (O(log N)): pick smallest adequate from size index; split & re-index 
-void* malloc_best_fit(size_t size){
-    if (!size) return NULL;
-    if (!heap0_inited) heap_bootstrap();
-    current_strategy = ALLOC_STRATEGY_BEST;
-    free_blk_t *best = sidx_ge(size);
-    if (!best) return NULL;
-    free_blk_t *prev = best->aprev, *next = best->anext;
-    alu(best);
-    sidx_remove_exact(best);
-    free_blk_t *rem = smt(best, size);
-    if (rem){ alb(prev, next, rem); sidx_insert(rem); }
-    best->is_free = 0; best->magic = MAGIC_A;
-    return (char*)best + HDRSZ;
-}
-// Worst-fit (O(log N)): pick largest from size index; split & re-index. 
-void* malloc_worst_fit(size_t size){
-    if (!size) return NULL;
-    if (!heap0_inited) heap_bootstrap();
-    current_strategy = ALLOC_STRATEGY_WORST;
-    free_blk_t *w = sidx_max();
-    if (!w || w->sz < size) return NULL;
-    free_blk_t *prev = w->aprev, *next = w->anext;
-    alu(w);
-    sidx_remove_exact(w);
-    free_blk_t *rem = smt(w, size);
-    if (rem){ alb(prev, next, rem); sidx_insert(rem); }
-    w->is_free = 0; w->magic = MAGIC_A;
-    return (char*)w + HDRSZ;
+// every public allocation leaves through here
+static void* alloc_done(void *p, size_t size, int strategy, void *site){
+    PROBE3(alloc__return, strategy, size, p);
+    if (!p) return NULL;
+    HOOK(allocator_on_alloc, p, size, (allocator_strategy_t)strategy);
+    return site_note(p, site);
 }
+void* malloc_first_fit(size_t size){ return alloc_done(heap_call(first_fit, ALLOC_STRATEGY_FIRST, size), size, ALLOC_STRATEGY_FIRST, CALLER); }
+void* malloc_next_fit(size_t size) { return alloc_done(heap_call(next_fit,  ALLOC_STRATEGY_NEXT,  size), size, ALLOC_STRATEGY_NEXT,  CALLER); }
+void* malloc_best_fit(size_t size) { return alloc_done(heap_call(best_fit,  ALLOC_STRATEGY_BEST,  size), size, ALLOC_STRATEGY_BEST,  CALLER); }
+void* malloc_worst_fit(size_t size){ return alloc_done(heap_call(worst_fit, ALLOC_STRATEGY_WORST, size), size, ALLOC_STRATEGY_WORST, CALLER); }
+
 // Buddy allocator
-static void b_init(void){
-    if (b_inited) return;
-    void *p = mmap(NULL, HEAP_SIZE, PROT_READ|PROT_WRITE,
-                   MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
-    if (p == MAP_FAILED){ perror("mmap(buddy)"); _exit(1); }
-    b_arena = p;
+// called with bud_lk held; -1 if the arena could not be mapped
+static int b_init(void){
+    if (b_inited) return 0;
+    if (!b_arena){
+        void *p = mmap(NULL, BUD_SIZE, PROT_READ|PROT_WRITE,
+                       MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED){ DBG("mmap(buddy) failed\n"); return -1; }
+        b_arena = p;
+        PROBE2(arena__map, p, BUD_SIZE);
+        HOOK(allocator_on_arena_map, p, BUD_SIZE);
+    }
     for (int i=0;i<MAXORD;i++) bfl[i]=NULL;
-    bud_t *b = (bud_t*)p;
+    memset(&bst, 0, sizeof bst);
+    memset(b_bmap, 0, sizeof b_bmap);
+    bud_t *b = (bud_t*)b_arena;
+    UNPOISON_META(b, BUDHDR);
     b->sz = (size_t)1 << (MAXORD-1);
     b->order = MAXORD-1;
     b->magic = MAGIC_F; b->is_free = 1;
     b->next = b->prev = NULL;
+    POISON((char*)b + BUDHDR, b->sz - BUDHDR);
     bfl[b->order] = b;
+    BBIT_SET(b);
+    bst.free_blocks = 1; bst.free_bytes = b->sz;
     b_inited = 1;
+    return 0;
 }
 static bud_t* bgb(int order){
     int k = order;
@@ -385,37 +1609,103 @@ static bud_t* bgb(int order){
     bud_t *b = bfl[k];
     bfl[k] = b->next; if (b->next) b->next->prev = NULL;
     b->next = b->prev = NULL;
+    bst.free_blocks--; bst.free_bytes -= b->sz;
     while (k > order){
         k--;
         size_t half = (size_t)1 << k;
         bud_t *L = b;
         bud_t *R = (bud_t*)((char*)b + half);
+        UNPOISON_META(R, BUDHDR);        // was inside b's payload
         L->sz = R->sz = half;
         L->order = R->order = (uint8_t)k;
         L->magic = R->magic = MAGIC_F;
         L->is_free = R->is_free = 1;
+        BBIT_SET(R);
         R->next = bfl[k]; R->prev = NULL;
         if (bfl[k]) bfl[k]->prev = R;
         bfl[k] = R;
         b = L;
+        bst.splits++; bst.free_blocks++; bst.free_bytes += half;
+        PROBE1(buddy__split, k);
     }
     b->is_free = 0; b->magic = MAGIC_A;
+    bst.alloc_blocks++; bst.alloc_bytes += b->sz;
     return b;
 }
 static inline bud_t* b_buddy(bud_t *b){
     size_t sz = (size_t)1 << b->order;
     uintptr_t off  = (uintptr_t)((char*)b - (char*)b_arena);
     uintptr_t boff = off ^ sz;
-    return (boff < HEAP_SIZE) ? (bud_t*)((char*)b_arena + boff) : NULL;
+    return (boff < BUD_SIZE) ? (bud_t*)((char*)b_arena + boff) : NULL;
+}
+/* Tail trimming (opt-in)
+ * A request gets the smallest order that holds it, which can waste up to
+ * half the block. With trimming on, only the request rounded up to
+ * 1 << BUD_TRIM_ORD stays allocated; the rest of the block goes straight
+ * back as aligned power-of-two pieces, so a 5 KiB request keeps 5 KiB +
+ * granularity of an 8 KiB block. Such a block keeps the order it was cut
+ * from, with sz < 1 << order. Its interior has no headers (nor bitmap
+ * bits) while it is live, which is why every buddy probe checks the bit
+ * before the header; on free it is cut into pieces again, each of which
+ * merges normally.
+ */
+#define BUD_TRIM_ORD 6                   // 64 bytes, room for a free header
+static _Atomic int bud_trim_on = 0;
+
+static void bud_link(bud_t *b);
+
+// give the tail of freshly taken b (size bytes of payload wanted) back
+static void bud_trim(bud_t *b, size_t size){
+    size_t gran = (size_t)1 << BUD_TRIM_ORD;
+    size_t keep = (size + BUDHDR + gran - 1) & ~(gran - 1);
+    if (!atomic_load_explicit(&bud_trim_on, memory_order_relaxed) || keep >= b->sz) return;
+    bst.alloc_bytes -= b->sz - keep;
+    // pieces grow with their alignment: [keep, end) splits as keep's low bits
+    for (size_t at = keep, piece; at < b->sz; at += piece){
+        piece = at & -at;
+        bud_t *R = (bud_t*)((char*)b + at);
+        UNPOISON_META(R, BUDHDR);        // was inside b's payload
+        R->sz = piece;
+        R->order = (uint8_t)__builtin_ctzll(piece);
+        BBIT_SET(R);
+        bst.splits++;
+        PROBE1(buddy__split, R->order);
+        bud_link(R);                     // its buddy is below, inside b: no merge
+    }
+    b->sz = keep;
+}
+// free a trimmed b: cut it into aligned pieces again, largest first
+static void bud_untrim(bud_t *b){
+    size_t sz = b->sz, at = 0;
+    for (int j = b->order - 1; j >= BUD_TRIM_ORD; j--){
+        if (!(sz & ((size_t)1 << j))) continue;
+        bud_t *P = (bud_t*)((char*)b + at);
+        if (at){
+            UNPOISON_META(P, BUDHDR);    // was user payload
+            BBIT_SET(P);
+        }
+        P->sz = (size_t)1 << j;
+        P->order = (uint8_t)j;
+        bud_link(P);
+        at += (size_t)1 << j;
+    }
 }
 static void bfm(bud_t *b){
+    MARK_FREE((char*)b + BUDHDR, b->sz - BUDHDR);
+    bst.alloc_blocks--; bst.alloc_bytes -= b->sz;
+    if (b->sz != (size_t)1 << b->order) bud_untrim(b);
+    else bud_link(b);
+}
+// put free b on its list and merge it upward as far as it goes
+static void bud_link(bud_t *b){
+    bst.free_blocks++;  bst.free_bytes  += b->sz;
     b->is_free = 1; b->magic = MAGIC_F;
     b->next = bfl[b->order]; b->prev = NULL;
     if (bfl[b->order]) bfl[b->order]->prev = b;
     bfl[b->order] = b;
     while (b->order < MAXORD-1){
         bud_t *m = b_buddy(b);
-        if (!m || !m->is_free || m->order != b->order) break;
+        if (!m || !BBIT_HAS(m) || !bud_free_at(m, b->order)) break;
         if (m->prev) m->prev->next = m->next;
         else         bfl[m->order] = m->next;
         if (m->next) m->next->prev = m->prev;
@@ -424,77 +1714,1196 @@ static void bfm(bud_t *b){
         else         bfl[b->order] = b->next;
         if (b->next) b->next->prev = b->prev;
         // merged block starts at lower address of the pair
+        BBIT_CLR((uintptr_t)m < (uintptr_t)b ? b : m);
         b = ((uintptr_t)m < (uintptr_t)b) ? m : b;
         b->order++; b->sz <<= 1;
+        bst.merges++; bst.free_blocks--;
+        PROBE1(buddy__merge, b->order);
         b->prev = b->next = NULL;
         b->next = bfl[b->order]; b->prev = NULL;
         if (bfl[b->order]) bfl[b->order]->prev = b;
         bfl[b->order] = b;
     }
 }
-void* malloc_buddy_alloc(size_t size){
-    if (!size) return NULL;
-    if (!b_inited) b_init();
-    current_strategy = ALLOC_STRATEGY_BUDDY;
-
+// smallest order whose block holds size bytes of payload, MAXORD if none
+static int bud_order(size_t size){
+    if (size > BUD_SIZE) return MAXORD;
     size_t need = size + BUDHDR;
     int order = 0; size_t blk = 1;
     while (blk < need && order < MAXORD){ blk <<= 1; order++; }
-    if (order >= MAXORD) return NULL;
-    bud_t *b = bgb(order);
-    if (!b) return NULL;
-    return (char*)b + BUDHDR;
+    return order;
+}
+static void* bud_take(size_t size){
+    int order = bud_order(size);
+    lk_take(&bud_lk);
+    bud_t *b = (order < MAXORD && b_init() == 0) ? bgb(order) : NULL;
+    if (b){
+        bud_trim(b, size);
+        trace_note(ALLOC_TRACE_ALLOC, ALLOC_STRATEGY_BUDDY, 0, size,
+                   (size_t)((char*)b + BUDHDR - (char*)b_arena));
+        MARK_ALLOC((char*)b + BUDHDR, size);
+        POISON(b, BUDHDR);
+    }
+    lk_drop(&bud_lk);
+    return b ? (char*)b + BUDHDR : NULL;
+}
+// called with bud_lk held, b from bud_hdr(); 1 if it was freed
+static int bud_free(bud_t *b){
+    if (!b || peek_magic(&b->magic) != MAGIC_A) return 0;  // this will get  silent on invalid
+    UNPOISON_META(b, BUDHDR);
+    trace_note(ALLOC_TRACE_FREE, ALLOC_STRATEGY_BUDDY, 0, 0,
+               (size_t)((char*)b + BUDHDR - (char*)b_arena));
+    bfm(b);
+    return 1;
+}
+/* Resize b (allocated, header open) to order t without moving it. Growing
+ * absorbs the higher buddy at each order on the way up, so it only works
+ * when b is the lower half every time and all those buddies are free at
+ * exactly their order; shrinking splits off upper halves and frees them
+ * (their buddy is b, so they cannot merge). A trimmed b stays as it is
+ * while size bytes still fit in what it kept. 0 if it has to move instead.
+ * Called with bud_lk held.
+ */
+static int bud_resize(bud_t *b, int t, size_t size){
+    uintptr_t off = (uintptr_t)((char*)b - (char*)b_arena);
+    if (b->sz != (size_t)1 << b->order) return size <= b->sz - BUDHDR;
+    if (t >= MAXORD || off & (((size_t)1 << t) - 1)) return 0;
+    for (int k = b->order; k < t; k++){
+        bud_t *m = (bud_t*)((char*)b + ((size_t)1 << k));
+        if (!BBIT_HAS(m) || !bud_free_at(m, (uint8_t)k)) return 0;
+    }
+    for (int k = b->order; k < t; k++){
+        bud_t *m = (bud_t*)((char*)b + ((size_t)1 << k));
+        if (m->prev) m->prev->next = m->next;
+        else         bfl[k] = m->next;
+        if (m->next) m->next->prev = m->prev;
+        BBIT_CLR(m);
+        bst.merges++; bst.free_blocks--; bst.free_bytes -= m->sz;
+        bst.alloc_bytes += m->sz;
+        PROBE1(buddy__merge, k + 1);
+    }
+    for (int k = b->order - 1; k >= t; k--){
+        bud_t *R = (bud_t*)((char*)b + ((size_t)1 << k));
+        UNPOISON_META(R, BUDHDR);        // was user payload
+        R->sz = (size_t)1 << k;
+        R->order = (uint8_t)k;
+        R->magic = MAGIC_F; R->is_free = 1;
+        POISON((char*)R + BUDHDR, R->sz - BUDHDR);
+        BBIT_SET(R);
+        R->next = bfl[k]; R->prev = NULL;
+        if (bfl[k]) bfl[k]->prev = R;
+        bfl[k] = R;
+        bst.splits++; bst.free_blocks++; bst.free_bytes += R->sz;
+        bst.alloc_bytes -= R->sz;
+        PROBE1(buddy__split, k);
+    }
+    b->order = (uint8_t)t;
+    b->sz = (size_t)1 << t;
+    return 1;
+}
+/* Buddy realloc: in place when bud_resize can, else a new buddy block
+ * (taken and filled under the same lock hold) and the old one freed.
+ * NULL if ptr is not a live buddy block or there is no room. */
+static void* realloc_at(void *ptr, size_t size, void *site);
+
+static void* bud_realloc(void *ptr, size_t size, void *site){
+    PROBE2(alloc__entry, ALLOC_STRATEGY_BUDDY, size);
+    int t = bud_order(size);
+    if (t >= MAXORD){ errno = ENOMEM; return alloc_done(NULL, size, ALLOC_STRATEGY_BUDDY, NULL); }
+    void *q = NULL;
+    int full;
+    // no room to move: the OOM handler may free some, then look again
+    do{
+        full = 0;
+        lk_take(&bud_lk);
+        bud_t *b = b_inited ? bud_hdr(ptr) : NULL;
+        if (b && peek_magic(&b->magic) == MAGIC_A){
+            UNPOISON_META(b, BUDHDR);
+            size_t had = b->sz - BUDHDR;
+            if (bud_resize(b, t, size)){
+                trace_note(ALLOC_TRACE_RESIZE, ALLOC_STRATEGY_BUDDY, 0, size,
+                           (size_t)((char*)ptr - (char*)b_arena));
+                MARK_RESIZE(ptr, size, b->sz - BUDHDR);
+                q = ptr;
+            }else{
+                bud_t *n = bgb(t);
+                if (n){
+                    bud_trim(n, size);
+                    q = (char*)n + BUDHDR;
+                    trace_note(ALLOC_TRACE_ALLOC, ALLOC_STRATEGY_BUDDY, 0, size,
+                               (size_t)((char*)q - (char*)b_arena));
+                    MARK_ALLOC(q, size);
+                    POISON(n, BUDHDR);
+                    UNPOISON_META(ptr, had);  // slack past the old request gets copied too
+                    memcpy(q, ptr, had < size ? had : size);
+                    trace_note(ALLOC_TRACE_FREE, ALLOC_STRATEGY_BUDDY, 0, 0,
+                               (size_t)((char*)ptr - (char*)b_arena));
+                    bfm(b);
+                }else full = 1;
+            }
+            if (!q || q == ptr) POISON(b, BUDHDR);    // b is still allocated
+        }
+        lk_drop(&bud_lk);
+    }while (full && oom_retry(size, ALLOC_STRATEGY_BUDDY));
+    if (!q) return alloc_done(NULL, size, ALLOC_STRATEGY_BUDDY, NULL);
+    site_drop(ptr);
+    HOOK(allocator_on_free, ptr);
+    return alloc_done(q, size, ALLOC_STRATEGY_BUDDY, site);
+}
+void* realloc_buddy(void *ptr, size_t size){
+    if (!ptr){
+        PROBE2(alloc__entry, ALLOC_STRATEGY_BUDDY, size);
+        return alloc_done(bud_take(size), size, ALLOC_STRATEGY_BUDDY, CALLER);
+    }
+    if (!size){ my_free(ptr); return NULL; }
+    // a sampled malloc_buddy_alloc may have handed out a guarded block
+    if (!b_inited || (uintptr_t)ptr - (uintptr_t)b_arena >= BUD_SIZE)
+        return realloc_at(ptr, size, CALLER);
+    return bud_realloc(ptr, size, CALLER);
+}
+void* malloc_buddy_alloc(size_t size){
+    PROBE2(alloc__entry, ALLOC_STRATEGY_BUDDY, size);
+    if (!size) return alloc_done(NULL, size, ALLOC_STRATEGY_BUDDY, NULL);
+    note_strategy(ALLOC_STRATEGY_BUDDY);
+    if (bud_order(size) < MAXORD && guard_pick(ALLOC_STRATEGY_BUDDY)){
+        void *g = guard_alloc(size);
+        if (g) return alloc_done(g, size, ALLOC_STRATEGY_BUDDY, CALLER);
+    }
+
+    void *p;
+    do{
+        if ((p = bud_take(size))) return alloc_done(p, size, ALLOC_STRATEGY_BUDDY, CALLER);
+    }while (oom_retry(size, ALLOC_STRATEGY_BUDDY));
+    return alloc_done(NULL, size, ALLOC_STRATEGY_BUDDY, NULL);
+}
+
+/* Fibonacci buddy (separate arena)
+ * Block sizes are Fibonacci multiples of FUNIT, so consecutive classes are
+ * ~1.6x apart instead of 2x and a request wastes less of its block. A
+ * block of order k splits into a left child of order k-1 and a right one
+ * of order k-2. Buddies are no longer found by xor: each header carries
+ * its split path (one bit per level, 0 = left, 1 = right, under a leading
+ * 1 for the root), which says which side its buddy is on and what order
+ * and path the buddy must have. Same arena registry bitmap as the others.
+ */
+#define FUNIT   ((size_t)16)
+#define FORD    12                       // orders 0..FORD-1
+#define FMIN    2                        // smallest order that holds a header
+static const size_t fibn[FORD] = {1, 2, 3, 5, 8, 13, 21, 34, 55, 89, 144, 233};
+#define FSZ(k)  (fibn[k] * FUNIT)
+#define F_SIZE  ((size_t)233 * FUNIT)    // FSZ(FORD-1), 3728 bytes, close to BUD_SIZE
+
+typedef struct fib {
+    size_t    sz;
+    struct fib *next, *prev;             // free list per order
+    uint64_t  path;                      // split path from the root, root = 1
+    uint32_t  magic;
+    uint8_t   order;
+    uint8_t   is_free;
+} fib_t;
+
+#define FHDR ((size_t)sizeof(fib_t))
+_Static_assert(FHDR + 8 <= 3 * FUNIT, "FMIN block cannot hold a header");
+
+static void  *f_arena = NULL;
+static _Atomic int f_inited = 0;         // set last, read by my_free unlocked
+static fib_t *ffl[FORD];
+static hstat_t fst;
+static uint64_t f_bmap[BMAP_ALL(F_SIZE)];
+
+#define FBIT_SET(b)   bm_set(f_bmap, F_SIZE, (size_t)((char*)(b) - (char*)f_arena))
+#define FBIT_CLR(b)   bm_clr(f_bmap, F_SIZE, (size_t)((char*)(b) - (char*)f_arena))
+#define FBIT_HAS(b)   bm_has(f_bmap, F_SIZE, (size_t)((char*)(b) - (char*)f_arena))
+
+static fib_t* fib_hdr(void *ptr){
+    uintptr_t off = (uintptr_t)ptr - FHDR - (uintptr_t)f_arena;
+    return bm_has(f_bmap, F_SIZE, off) ? (fib_t*)((char*)ptr - FHDR) : NULL;
+}
+// is m a free block of this order and path? m may be allocated
+static NOSAN int fib_free_at(const fib_t *m, uint8_t order, uint64_t path){
+    PEEK_BEGIN();
+    const volatile fib_t *v = (const volatile fib_t*)m;
+    int r = v->is_free && v->order == order && v->path == path;
+    PEEK_END();
+    return r;
 }
+static void fl_push(fib_t *b){
+    b->next = ffl[b->order]; b->prev = NULL;
+    if (ffl[b->order]) ffl[b->order]->prev = b;
+    ffl[b->order] = b;
+}
+static void fl_pull(fib_t *b){
+    if (b->prev) b->prev->next = b->next;
+    else         ffl[b->order] = b->next;
+    if (b->next) b->next->prev = b->prev;
+    b->next = b->prev = NULL;
+}
+// called with fib_lk held; -1 if the arena could not be mapped
+static int f_init(void){
+    if (f_inited) return 0;
+    if (!f_arena){
+        void *p = mmap(NULL, F_SIZE, PROT_READ|PROT_WRITE,
+                       MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED){ DBG("mmap(fib) failed\n"); return -1; }
+        f_arena = p;
+        PROBE2(arena__map, p, F_SIZE);
+        HOOK(allocator_on_arena_map, p, F_SIZE);
+    }
+    for (int i=0;i<FORD;i++) ffl[i]=NULL;
+    memset(&fst, 0, sizeof fst);
+    memset(f_bmap, 0, sizeof f_bmap);
+    fib_t *b = (fib_t*)f_arena;
+    UNPOISON_META(b, FHDR);
+    b->sz = F_SIZE;
+    b->order = FORD-1;
+    b->path = 1;
+    b->magic = MAGIC_F; b->is_free = 1;
+    POISON((char*)b + FHDR, b->sz - FHDR);
+    fl_push(b);
+    FBIT_SET(b);
+    fst.free_blocks = 1; fst.free_bytes = b->sz;
+    f_inited = 1;
+    return 0;
+}
+// take a block of exactly order (or the smallest bigger one that cannot split)
+static fib_t* fgb(int order){
+    int k = order;
+    while (k < FORD && !ffl[k]) k++;
+    if (k >= FORD) return NULL;
+    fib_t *b = ffl[k];
+    fl_pull(b);
+    fst.free_blocks--; fst.free_bytes -= b->sz;
+    while (k > order && k >= FMIN + 2){
+        fib_t *L = b;
+        fib_t *R = (fib_t*)((char*)b + FSZ(k-1));
+        UNPOISON_META(R, FHDR);          // was inside b's payload
+        uint64_t path = b->path << 1;
+        L->sz = FSZ(k-1); L->order = (uint8_t)(k-1); L->path = path;
+        R->sz = FSZ(k-2); R->order = (uint8_t)(k-2); R->path = path | 1;
+        L->magic = R->magic = MAGIC_F;
+        L->is_free = R->is_free = 1;
+        FBIT_SET(R);
+        // keep the child that still fits, the other one goes on its list
+        fib_t *spare = order <= k-2 ? L : R;
+        b = order <= k-2 ? R : L;
+        k = b->order;
+        fl_push(spare);
+        fst.splits++; fst.free_blocks++; fst.free_bytes += spare->sz;
+        PROBE1(buddy__split, k);
+    }
+    b->is_free = 0; b->magic = MAGIC_A;
+    fst.alloc_blocks++; fst.alloc_bytes += b->sz;
+    return b;
+}
+// free b and merge it with its buddy for as long as the buddy is free
+static void ffm(fib_t *b){
+    MARK_FREE((char*)b + FHDR, b->sz - FHDR);
+    fst.alloc_blocks--; fst.alloc_bytes -= b->sz;
+    fst.free_blocks++;  fst.free_bytes  += b->sz;
+    b->is_free = 1; b->magic = MAGIC_F;
+    while (b->path > 1){
+        int right = b->path & 1;
+        int k = right ? b->order + 2 : b->order + 1;      // parent order
+        fib_t *m = right ? (fib_t*)((char*)b - FSZ(k-1)) : (fib_t*)((char*)b + FSZ(k-1));
+        uint8_t morder = (uint8_t)(right ? k-1 : k-2);
+        if (!FBIT_HAS(m) || !fib_free_at(m, morder, b->path ^ 1)) break;
+        fl_pull(m);
+        fib_t *P = right ? m : b;
+        FBIT_CLR(right ? b : m);
+        P->order = (uint8_t)k;
+        P->sz = FSZ(k);
+        P->path = b->path >> 1;
+        b = P;
+        fst.merges++; fst.free_blocks--;
+        PROBE1(buddy__merge, k);
+    }
+    fl_push(b);
+}
+static int fib_order(size_t size){
+    if (size > F_SIZE) return FORD;
+    int k = FMIN;
+    while (k < FORD && FSZ(k) < size + FHDR) k++;
+    return k;
+}
+static void* fib_take(size_t size){
+    int order = fib_order(size);
+    lk_take(&fib_lk);
+    fib_t *b = (order < FORD && f_init() == 0) ? fgb(order) : NULL;
+    if (b){
+        trace_note(ALLOC_TRACE_ALLOC, ALLOC_STRATEGY_FIB, 0, size,
+                   (size_t)((char*)b + FHDR - (char*)f_arena));
+        MARK_ALLOC((char*)b + FHDR, size);
+        POISON(b, FHDR);
+    }
+    lk_drop(&fib_lk);
+    return b ? (char*)b + FHDR : NULL;
+}
+// called with fib_lk held, b from fib_hdr(); 1 if it was freed
+static int fib_free(fib_t *b){
+    if (!b || peek_magic(&b->magic) != MAGIC_A) return 0;
+    UNPOISON_META(b, FHDR);
+    trace_note(ALLOC_TRACE_FREE, ALLOC_STRATEGY_FIB, 0, 0,
+               (size_t)((char*)b + FHDR - (char*)f_arena));
+    ffm(b);
+    return 1;
+}
+void* malloc_fib_buddy(size_t size){
+    PROBE2(alloc__entry, ALLOC_STRATEGY_FIB, size);
+    if (!size) return alloc_done(NULL, size, ALLOC_STRATEGY_FIB, NULL);
+    note_strategy(ALLOC_STRATEGY_FIB);
+    if (fib_order(size) < FORD && guard_pick(ALLOC_STRATEGY_FIB)){
+        void *g = guard_alloc(size);
+        if (g) return alloc_done(g, size, ALLOC_STRATEGY_FIB, CALLER);
+    }
+    void *p;
+    do{
+        if ((p = fib_take(size))) return alloc_done(p, size, ALLOC_STRATEGY_FIB, CALLER);
+    }while (oom_retry(size, ALLOC_STRATEGY_FIB));
+    return alloc_done(NULL, size, ALLOC_STRATEGY_FIB, NULL);
+}
+static int heap_free(heap_t *h, free_blk_t *blk);
+
+// owning shard of a fit-heap pointer, NULL if it is not ours
+static heap_t* ptr_shard(void *ptr){
+    if (!shard_mapped) return NULL;
+    uintptr_t off = (uintptr_t)ptr - (uintptr_t)shard_base;
+    if ((uintptr_t)ptr < (uintptr_t)shard_base ||
+        off >= (uintptr_t)NSHARD * HEAP_RESERVE) return NULL;
+    return &shards[off / HEAP_RESERVE];
+}
+
 /* Free
  * Put block back in address order list, also add it to size index, then try merge with neighbors.
  * Error rule: if bad pointer or double free, just return quiet (no print).
  */
 void my_free(void *ptr){
     if (!ptr) return;
+    PROBE1(free__entry, ptr);
+    site_drop(ptr);
     // the Buddy pointer////
     if (b_inited){
         uintptr_t p  = (uintptr_t)ptr;
-        uintptr_t b0 = (uintptr_t)b_arena, b1 = b0 + HEAP_SIZE;
+        uintptr_t b0 = (uintptr_t)b_arena, b1 = b0 + BUD_SIZE;
         if (p >= b0 && p < b1){
-            bud_t *b = (bud_t*)((char*)ptr - BUDHDR);
-            if (b->magic != MAGIC_A) return;  // this will get  silent on invalid
-            bfm(b);
+            lk_take(&bud_lk);
+            int ok = bud_free(bud_hdr(ptr));
+            lk_drop(&bud_lk);
+            PROBE2(free__return, ptr, ok);
+            if (ok) HOOK(allocator_on_free, ptr);
             return;
         }
     }
-    if (!heap0_inited) return;
-    free_blk_t *blk = (free_blk_t*)((char*)ptr - HDRSZ);
-    if (blk->magic != MAGIC_A) return;       // this will get  silent on invalidd
-    // Insert by address
-    if (!alist_head){
-        alist_head = blk; blk->aprev = blk->anext = NULL;
-    }else{
-        free_blk_t *cur = alist_head, *prv = NULL;
-        while (cur && (uintptr_t)cur < (uintptr_t)blk){ prv = cur; cur = cur->anext; }
-        alb(prv, cur, blk);
+    if (f_inited && (uintptr_t)ptr - (uintptr_t)f_arena < F_SIZE){
+        lk_take(&fib_lk);
+        int ok = fib_free(fib_hdr(ptr));
+        lk_drop(&fib_lk);
+        PROBE2(free__return, ptr, ok);
+        if (ok) HOOK(allocator_on_free, ptr);
+        return;
     }
+    heap_t *h = ptr_shard(ptr);
+    int ok;
+    if (!h) ok = guard_free(ptr) || large_free(ptr);
+    else{
+        lk_take(&h->lk);
+        ok = h->inited && heap_free(h, heap_hdr(h, ptr));
+        lk_drop(&h->lk);
+    }
+    PROBE2(free__return, ptr, ok);
+    if (ok) HOOK(allocator_on_free, ptr);
+}
+
+/* Link blk between prv and cur (address order), index it, merge it.
+ * Returns the block blk ended up in, so a sweep can carry on from there. */
+static free_blk_t* heap_put(heap_t *h, free_blk_t *prv, free_blk_t *cur, free_blk_t *blk){
+    MARK_FREE((char*)blk + HDRSZ, blk->sz);
+    trace_note(ALLOC_TRACE_FREE, 0, (int)(h - shards), 0,
+               (size_t)((char*)blk + HDRSZ - (char*)h->heap0));
+    h->st.alloc_blocks--; h->st.alloc_bytes -= blk->sz;
+    fl_link(&h->fl, prv, cur, blk);
     blk->is_free = 1; blk->magic = MAGIC_F;
-    for (int i=0;i<SKLVL;i++) blk->snext[i]=NULL;
-    blk->lvl = 1;
-    sidx_insert(blk);
+    sk_reset(&blk->sk);
+    sidx_insert(h, blk);
+    free_blk_t *m = cola(h, blk);           // rover might be updated inside 
+    POISON((char*)m + HDRSZ, m->sz);        // swallowed headers are payload now
+    return m;
+}
 
-    (void)cola(blk);              // rover might be updated inside 
+// called with h->lk held, blk from heap_hdr(); 1 if it was freed
+static int heap_free(heap_t *h, free_blk_t *blk){
+    if (!blk || peek_magic(&blk->magic) != MAGIC_A) return 0;  // this will get  silent on invalidd
+    UNPOISON_META(blk, HDRSZ);
+    // Insert by address
+    free_blk_t *cur = h->fl.head, *prv = NULL;
+    while (cur && (uintptr_t)cur < (uintptr_t)blk){ prv = cur; cur = cur->anext; }
+    (void)heap_put(h, prv, cur, blk);
+    heap_trim(h);
 #ifdef MMU_DEBUG
-    for (free_blk_t *q = alist_head; q && q->anext; q=q->anext){
+    for (free_blk_t *q = h->fl.head; q && q->anext; q=q->anext){
         assert((uintptr_t)q < (uintptr_t)q->anext);
         assert(!adjacent(q, q->anext));
     }
 #endif
+    return 1;
+}
+
+/* Async free
+ * my_free_async only flips the header magic A -> Q (so a second free of the
+ * same pointer is dropped instead of looping the stack) and pushes the block
+ * on its shard's lock-free stack, linked through anext which an allocated
+ * block does not use. Whoever next takes the shard lock for an allocation
+ * (or allocator_drain_async) swaps the whole stack out, sorts it by address
+ * and puts it back with one forward sweep of the address list.
+ */
+static free_blk_t* q_sort(free_blk_t *l){
+    if (!l || !l->anext) return l;
+    free_blk_t *slow = l, *fast = l->anext;
+    while (fast && fast->anext){ slow = slow->anext; fast = fast->anext->anext; }
+    free_blk_t *r = slow->anext; slow->anext = NULL;
+    l = q_sort(l); r = q_sort(r);
+    free_blk_t head, *t = &head;
+    while (l && r){
+        if ((uintptr_t)l < (uintptr_t)r){ t->anext = l; l = l->anext; }
+        else                            { t->anext = r; r = r->anext; }
+        t = t->anext;
+    }
+    t->anext = l ? l : r;
+    return head.anext;
+}
+// called with h->lk held
+static void heap_drain(heap_t *h){
+    free_blk_t *q = atomic_exchange_explicit(&h->pending, NULL, memory_order_acquire);
+    q = q_sort(q);
+    free_blk_t *prv = NULL, *cur = h->fl.head;
+    while (q){
+        free_blk_t *blk = q; q = q->anext;
+        while (cur && (uintptr_t)cur < (uintptr_t)blk){ prv = cur; cur = cur->anext; }
+        free_blk_t *m = heap_put(h, prv, cur, blk);
+        prv = m; cur = m->anext;
+    }
+    heap_trim(h);
+}
+void my_free_async(void *ptr){
+    if (!ptr) return;
+    site_drop(ptr);
+    heap_t *h = ptr_shard(ptr);
+    if (!h){ my_free(ptr); return; }   // buddy is cheap enough to free inline
+    // unlocked bitmap read: a live block's bit can't go away under us
+    free_blk_t *blk = heap_hdr_unlocked(h, ptr);
+    if (!blk || peek_magic(&blk->magic) != MAGIC_A) return;
+    UNPOISON_META(blk, HDRSZ);
+    uint32_t want = MAGIC_A;
+    if (!__atomic_compare_exchange_n(&blk->magic, &want, MAGIC_Q, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) return;
+    HOOK(allocator_on_free, ptr);
+    free_blk_t *top = atomic_load_explicit(&h->pending, memory_order_relaxed);
+    do{
+        blk->anext = top;
+    }while (!atomic_compare_exchange_weak_explicit(&h->pending, &top, blk,
+                memory_order_release, memory_order_relaxed));
+}
+void allocator_drain_async(void){
+    for (int i=0;i<NSHARD;i++){
+        heap_t *h = &shards[i];
+        if (!atomic_load_explicit(&h->pending, memory_order_relaxed)) continue;
+        lk_take(&h->lk);
+        heap_drain(h);
+        lk_drop(&h->lk);
+    }
+}
+
+/* Heap walk
+ * Blocks are read straight off the bitmaps: a block runs from its bit to
+ * the next set one (or the arena end), so neither sizes nor list links are
+ * chased, the only header field looked at is the magic (live or not).
+ * Interior lookups are one backward bit search. The arena lock is held
+ * while a callback runs, so it must not call back into the allocator.
+ */
+static void blk_heap(heap_t *h, size_t off, size_t end, allocator_block_t *out){
+    free_blk_t *b = (free_blk_t*)((char*)h->heap0 + off);
+    out->ptr = (char*)b + HDRSZ;
+    out->size = end - off - HDRSZ;
+    out->allocated = peek_magic(&b->magic) == MAGIC_A;
+    out->arena = (int)(h - shards);
+}
+static void blk_bud(size_t off, size_t end, allocator_block_t *out){
+    bud_t *b = (bud_t*)((char*)b_arena + off);
+    out->ptr = (char*)b + BUDHDR;
+    out->size = end - off - BUDHDR;
+    out->allocated = peek_magic(&b->magic) == MAGIC_A;
+    out->arena = ALLOC_ARENA_BUDDY;
+}
+static void blk_fib(size_t off, size_t end, allocator_block_t *out){
+    fib_t *b = (fib_t*)((char*)f_arena + off);
+    out->ptr = (char*)b + FHDR;
+    out->size = end - off - FHDR;
+    out->allocated = peek_magic(&b->magic) == MAGIC_A;
+    out->arena = ALLOC_ARENA_FIB;
+}
+static void blk_guard(char *user, allocator_block_t *out){
+    out->ptr = user;
+    out->size = ((ghdr_t*)(user - GHDR))->sz;
+    out->allocated = 1;
+    out->arena = ALLOC_ARENA_GUARD;
+}
+static void blk_large(lhdr_t *l, allocator_block_t *out){
+    out->ptr = (char*)l + LHDR;
+    out->size = l->sz;
+    out->allocated = 1;
+    out->arena = ALLOC_ARENA_LARGE;
+}
+// block whose payload holds p, 0 if none
+static int blk_lookup(const void *p, allocator_block_t *out){
+    uintptr_t a = (uintptr_t)p;
+    int ok = 0;
+    if (b_inited && a - (uintptr_t)b_arena < BUD_SIZE){
+        size_t off = a - (uintptr_t)b_arena;
+        lk_take(&bud_lk);
+        size_t s = b_inited ? bm_prev(b_bmap, BUD_SIZE, off) : SIZE_MAX;
+        if (s != SIZE_MAX && off >= s + BUDHDR){
+            blk_bud(s, bm_next(b_bmap, BUD_SIZE, s), out);
+            ok = 1;
+        }
+        lk_drop(&bud_lk);
+        return ok;
+    }
+    if (f_inited && a - (uintptr_t)f_arena < F_SIZE){
+        size_t off = a - (uintptr_t)f_arena;
+        lk_take(&fib_lk);
+        size_t s = bm_prev(f_bmap, F_SIZE, off);
+        if (s != SIZE_MAX && off >= s + FHDR){
+            blk_fib(s, bm_next(f_bmap, F_SIZE, s), out);
+            ok = 1;
+        }
+        lk_drop(&fib_lk);
+        return ok;
+    }
+    heap_t *h = ptr_shard((void*)p);
+    if (h){
+        size_t off = a - (uintptr_t)h->heap0;
+        lk_take(&h->lk);
+        size_t s = h->inited && off < hlen(h) ? bm_prev(h->bmap, HEAP_RESERVE, off) : SIZE_MAX;
+        if (s != SIZE_MAX && off >= s + HDRSZ){
+            blk_heap(h, s, heap_next(h, s), out);
+            ok = 1;
+        }
+        lk_drop(&h->lk);
+        return ok;
+    }
+    char *u = guard_find(p);
+    if (u){ blk_guard(u, out); return 1; }
+    lhdr_t *l = large_find(p);
+    if (l) blk_large(l, out);
+    return l != NULL;
+}
+int allocator_lookup(const void *p, void **base, size_t *size){
+    allocator_block_t blk;
+    if (!blk_lookup(p, &blk) || !blk.allocated) return 0;
+    if (base) *base = blk.ptr;
+    if (size) *size = blk.size;
+    return 1;
+}
+/* Resize: NULL allocates (first fit), size 0 frees. Large blocks go
+ * through mremap. A fit or buddy block that already has the room stays
+ * where it is; otherwise the data moves to a new block (first fit, or
+ * the Fibonacci arena for its own blocks) and the old one is freed. Buddy
+ * blocks go to bud_realloc. NULL on failure or for
+ * a pointer we never handed out, the old block untouched then.
+ * Every resize of a live block is one alloc__entry/alloc__return pair,
+ * and a successful one is reported as on_free(old) then on_alloc(new),
+ * even when the pointer did not change.
+ */
+static void* realloc_at(void *ptr, size_t size, void *site){
+    void *p = ptr;
+    int strategy = 0;
+    int r = large_resize(&p, size, &strategy);
+    if (r < 0){ errno = ENOMEM; return alloc_done(NULL, size, strategy, NULL); }
+    if (r > 0){
+        site_drop(ptr);
+        HOOK(allocator_on_free, ptr);
+        return alloc_done(p, size, strategy, site);
+    }
+    allocator_block_t blk;
+    if (!blk_lookup(ptr, &blk) || !blk.allocated || blk.ptr != ptr) return NULL;
+    if (blk.arena == ALLOC_ARENA_BUDDY) return bud_realloc(ptr, size, site);
+    strategy = blk.arena == ALLOC_ARENA_FIB ? ALLOC_STRATEGY_FIB : ALLOC_STRATEGY_FIRST;
+    if (size <= blk.size && blk.arena != ALLOC_ARENA_GUARD){
+        PROBE2(alloc__entry, strategy, size);
+        MARK_RESIZE(ptr, size, blk.size);
+        site_drop(ptr);
+        HOOK(allocator_on_free, ptr);
+        return alloc_done(ptr, size, strategy, site);
+    }
+    if (strategy == ALLOC_STRATEGY_FIB){
+        PROBE2(alloc__entry, strategy, size);       // heap_call fires its own
+        do{
+            if ((p = fib_take(size))) break;
+        }while (oom_retry(size, strategy));
+    }else p = heap_call(first_fit, ALLOC_STRATEGY_FIRST, size);
+    if (!p) return alloc_done(NULL, size, strategy, NULL);
+    UNPOISON_META(ptr, blk.size);        // slack past the old request gets copied too
+    memcpy(p, ptr, blk.size < size ? blk.size : size);
+    my_free(ptr);
+    return alloc_done(p, size, strategy, site);
+}
+void* my_realloc(void *ptr, size_t size){
+    if (!ptr) return alloc_done(heap_call(first_fit, ALLOC_STRATEGY_FIRST, size),
+                                size, ALLOC_STRATEGY_FIRST, CALLER);
+    if (!size){ my_free(ptr); return NULL; }
+    return realloc_at(ptr, size, CALLER);
+}
+size_t allocator_walk(allocator_walk_fn fn, void *arg){
+    allocator_block_t blk;
+    size_t n = 0;
+    for (int i=0;i<NSHARD;i++){
+        heap_t *h = &shards[i];
+        lk_take(&h->lk);
+        for (size_t off = 0, end; h->inited && off < hlen(h); off = end, n++){
+            end = heap_next(h, off);
+            blk_heap(h, off, end, &blk);
+            if (fn) fn(&blk, arg);
+        }
+        lk_drop(&h->lk);
+    }
+    lk_take(&bud_lk);
+    for (size_t off = 0, end; b_inited && off < BUD_SIZE; off = end, n++){
+        end = bm_next(b_bmap, BUD_SIZE, off);
+        blk_bud(off, end, &blk);
+        if (fn) fn(&blk, arg);
+    }
+    lk_drop(&bud_lk);
+    lk_take(&fib_lk);
+    for (size_t off = 0, end; f_inited && off < F_SIZE; off = end, n++){
+        end = bm_next(f_bmap, F_SIZE, off);
+        blk_fib(off, end, &blk);
+        if (fn) fn(&blk, arg);
+    }
+    lk_drop(&fib_lk);
+    lk_take(&guard_lk);
+    for (size_t i=0;i<GUARD_TAB;i++){
+        pent_t *e = &guard_ents[i];
+        if (!e->key || e->key != page_of(e->val)) continue;  // once per mapping
+        blk_guard(e->val, &blk);
+        if (fn) fn(&blk, arg);
+        n++;
+    }
+    lk_drop(&guard_lk);
+    lk_take(&large_lk);
+    for (size_t i=0;i<LARGE_TAB;i++){
+        if (!large_ents[i].key) continue;
+        blk_large(large_ents[i].val, &blk);
+        if (fn) fn(&blk, arg);
+        n++;
+    }
+    lk_drop(&large_lk);
+    return n;
+}
+/* Conservative root scan: every aligned word in [lo, hi) that points into
+ * a live payload counts as a reference. The range is the caller's (stack,
+ * globals, another heap block), so the reads are not instrumented. */
+NOSAN size_t allocator_scan_roots(const void *lo, const void *hi,
+                                  allocator_root_fn fn, void *arg){
+    uintptr_t a = ((uintptr_t)lo + sizeof(void*) - 1) & ~(uintptr_t)(sizeof(void*) - 1);
+    size_t n = 0;
+    PEEK_BEGIN();
+    for (; a + sizeof(void*) <= (uintptr_t)hi; a += sizeof(void*)){
+        allocator_block_t blk;
+        const void *v = *(const void *const volatile*)a;
+        if (!blk_lookup(v, &blk) || !blk.allocated) continue;
+        if (fn) fn((const void*)a, &blk, arg);
+        n++;
+    }
+    PEEK_END();
+    return n;
+}
+
+/* Range allocator
+ * The fit engine for things that are not memory (file extents, ID ranges):
+ * the same fitlist_t, fl_find/fl_carve/fl_merge and rover rules as the
+ * heap, behind range ops. The difference is where the metadata lives:
+ * free ranges are nodes from a pool in the range's own mapping (a
+ * free_blk_t plus the offset), so the managed space is never read or
+ * written. Allocated ranges have no node at all, which is why free takes
+ * the length back. A split never rounds and leaves no tail rule: the
+ * leftover keeps the node. max_free caps how many disjoint free ranges
+ * can be tracked at once; the pool has one node more, since a free is
+ * linked first and merged after. Equal lengths sort by node slot rather
+ * than offset, which is just as deterministic.
+ */
+_Static_assert(sizeof(size_t) == sizeof(uint64_t), "range lengths are skip-list keys");
+
+typedef struct rnode {
+    free_blk_t fb;                       // first; fb.sz is the length, fb.anext links the pool
+    uint64_t   off;
+} rnode_t;
+
+struct allocator_range {
+    lk_t     lk;                         // guards everything below
+    uint64_t base, end;                  // managed span
+    uint64_t free_bytes;
+    size_t   free_ranges, max_free;
+    size_t   maplen;
+    fitlist_t fl;                        // free ranges
+    free_blk_t *pool;                    // unused nodes
+    uint32_t prng;
+    rnode_t  nodes[];                    // max_free + 1
+};
+
+#define RANGE_OF(l) ((allocator_range_t*)((char*)(l) - offsetof(allocator_range_t, fl)))
+static inline uint64_t roff(const free_blk_t *n){ return ((const rnode_t*)n)->off; }
+
+static free_blk_t* rn_get(allocator_range_t *r){
+    free_blk_t *n = r->pool;
+    if (n) r->pool = n->anext;
+    return n;
+}
+static void rn_put(allocator_range_t *r, free_blk_t *n){
+    n->anext = r->pool; r->pool = n;
+}
+static int r_adjacent(fitlist_t *l, free_blk_t *a, free_blk_t *b){
+    (void)l;
+    return roff(a) + a->sz == roff(b);
+}
+static void r_absorb(fitlist_t *l, free_blk_t *a, free_blk_t *b){
+    a->sz += b->sz;
+    rn_put(RANGE_OF(l), b);
+}
+static free_blk_t* r_split(fitlist_t *l, free_blk_t *n, size_t need){
+    (void)l;
+    if (n->sz == need) return NULL;
+    ((rnode_t*)n)->off += need; n->sz -= need;
+    return n;
+}
+static void r_index(fitlist_t *l, free_blk_t *n){
+    allocator_range_t *r = RANGE_OF(l);
+    (void)sk_insert(&l->sidx, &n->sk, pick_lvl(&r->prng, roff(n)));
+    r->free_ranges++; r->free_bytes += n->sz;
+}
+static void r_unindex(fitlist_t *l, free_blk_t *n){
+    allocator_range_t *r = RANGE_OF(l);
+    (void)sk_remove(&l->sidx, &n->sk);
+    r->free_ranges--; r->free_bytes -= n->sz;
+}
+
+static const fit_ops_t range_ops = { r_adjacent, r_absorb, r_split, r_index, r_unindex };
+
+// put [off, off+len) back, merging with free neighbours; -1 if it overlaps
+// free space or would be one disjoint range more than max_free
+static int rput(allocator_range_t *r, uint64_t off, uint64_t len){
+    free_blk_t *prv = NULL, *cur = r->fl.head;
+    while (cur && roff(cur) < off){ prv = cur; cur = cur->anext; }
+    if (prv && roff(prv) + prv->sz > off) return -1;
+    if (cur && off + len > roff(cur)) return -1;
+    if (r->free_ranges == r->max_free &&
+        !(prv && roff(prv) + prv->sz == off) && !(cur && off + len == roff(cur))) return -1;
+    free_blk_t *n = rn_get(r);               // never NULL, see the spare node
+    ((rnode_t*)n)->off = off; n->sz = len;
+    sk_reset(&n->sk);
+    fl_link(&r->fl, prv, cur, n);
+    r_index(&r->fl, n);
+    (void)fl_merge(&r->fl, &range_ops, n);
+    return 0;
+}
+
+allocator_range_t* allocator_range_create(uint64_t base, uint64_t length, size_t max_free){
+    if (!max_free || base + length < base ||
+        max_free >= (SIZE_MAX - sizeof(allocator_range_t)) / sizeof(rnode_t)) return NULL;
+    size_t pg = sys_page();
+    size_t len = sizeof(allocator_range_t) + (max_free + 1) * sizeof(rnode_t);
+    if (len > SIZE_MAX - pg) return NULL;
+    len = (len + pg - 1) & ~(pg - 1);
+    allocator_range_t *r = mmap(NULL, len, PROT_READ|PROT_WRITE,
+                                MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (r == MAP_FAILED) return NULL;
+    r->maplen = len;
+    r->base = base; r->end = base + length;
+    r->prng = PRNG_SEED;
+    r->max_free = max_free;
+    for (size_t i = max_free + 1; i-- > 0; ) rn_put(r, &r->nodes[i].fb);
+    if (length) rput(r, base, length);
+    return r;
+}
+void allocator_range_destroy(allocator_range_t *r){
+    if (r) munmap(r, r->maplen);
+}
+int allocator_range_alloc(allocator_range_t *r, uint64_t len,
+                          allocator_strategy_t strategy, uint64_t *off){
+    if (!r || !len || !off || strategy < ALLOC_STRATEGY_FIRST ||
+        strategy > ALLOC_STRATEGY_WORST){ errno = EINVAL; return -1; }
+    lk_take(&r->lk);
+    uint64_t hops = 0;                   // the heap counts these, ranges do not
+    free_blk_t *n = fl_find(&r->fl, strategy, len, &hops);
+    if (n){
+        *off = roff(n);
+        // front goes out; an exact fit leaves no leftover and frees the node
+        if (!fl_carve(&r->fl, &range_ops, n, len, strategy <= ALLOC_STRATEGY_NEXT)) rn_put(r, n);
+    }
+    lk_drop(&r->lk);
+    if (!n){ errno = ENOMEM; return -1; }
+    return 0;
+}
+int allocator_range_free(allocator_range_t *r, uint64_t off, uint64_t len){
+    if (!r || !len || off < r->base || off + len < off || off + len > r->end){
+        errno = EINVAL;
+        return -1;
+    }
+    lk_take(&r->lk);
+    int rc = rput(r, off, len);
+    lk_drop(&r->lk);
+    if (rc) errno = EINVAL;
+    return rc;
+}
+int allocator_range_add(allocator_range_t *r, uint64_t off, uint64_t len){
+    if (!r || !len || off + len < off){ errno = EINVAL; return -1; }
+    lk_take(&r->lk);
+    int rc = -1;
+    // only space outside the span: inside it, allocated ranges come back
+    // through allocator_range_free, which knows they were handed out
+    if (off >= r->end || off + len <= r->base){
+        uint64_t b = r->base, e = r->end;
+        if (r->base == r->end) r->base = r->end = off;   // empty span
+        if (off < r->base) r->base = off;
+        if (off + len > r->end) r->end = off + len;
+        rc = rput(r, off, len);
+        if (rc){ r->base = b; r->end = e; }
+    }
+    lk_drop(&r->lk);
+    if (rc) errno = EINVAL;
+    return rc;
+}
+void allocator_range_stats(allocator_range_t *r, allocator_range_stats_t *out){
+    if (!r || !out) return;
+    lk_take(&r->lk);
+    uint64_t hops = 0;
+    free_blk_t *top = (free_blk_t*)sk_max(&r->fl.sidx, &hops);
+    out->managed_bytes = r->end - r->base;
+    out->free_bytes    = r->free_bytes;
+    out->free_ranges   = r->free_ranges;
+    out->largest_free  = top ? top->sz : 0;
+    out->nodes_left    = r->max_free - r->free_ranges;
+    lk_drop(&r->lk);
+}
+
+/* Leak report
+ * Walks every arena and groups the live blocks by (usable size, site),
+ * heaviest group first. site is 0 unless site sampling caught the block;
+ * it is a raw return address, addr2line/gdb turn it into a line. All
+ * state is static (no malloc here either), so it is fine to run from
+ * atexit. Blocks parked by my_free_async count as gone.
+ */
+#define LEAK_GROUPS 64
+#define LEAK_ROWS   32                   // printed, heaviest first
+
+typedef struct {
+    size_t size;
+    void  *site;
+    size_t blocks, bytes;
+} lgrp_t;
+
+static lgrp_t leak_grp[LEAK_GROUPS + 1];  // last slot collects the overflow
+static size_t leak_ngrp;
+static lk_t   leak_lk;                   // guards leak_grp + leak_ngrp
+static _Atomic int leak_fd = -1;
+static _Atomic int leak_hooked = 0;
+
+static void leak_note(const allocator_block_t *blk, void *arg){
+    if (!blk->allocated) return;
+    void *site = site_of(blk->ptr);
+    size_t i = 0;
+    while (i < leak_ngrp && (leak_grp[i].size != blk->size || leak_grp[i].site != site)) i++;
+    if (i == leak_ngrp){
+        if (leak_ngrp < LEAK_GROUPS){
+            leak_grp[i].size = blk->size; leak_grp[i].site = site;
+            leak_grp[i].blocks = leak_grp[i].bytes = 0;
+            leak_ngrp++;
+        }else i = LEAK_GROUPS;           // overflow row, size/site stay 0
+    }
+    leak_grp[i].blocks++;
+    leak_grp[i].bytes += blk->size;
+    (*(size_t*)arg)++;
+}
+size_t allocator_leak_report(int fd){
+    lk_take(&leak_lk);
+    size_t n = 0, bytes = 0;
+    leak_ngrp = 0;
+    memset(&leak_grp[LEAK_GROUPS], 0, sizeof leak_grp[LEAK_GROUPS]);
+    (void)allocator_walk(leak_note, &n);
+    // insertion sort, heaviest first; there are at most LEAK_GROUPS rows
+    for (size_t i=1;i<leak_ngrp;i++){
+        lgrp_t g = leak_grp[i];
+        size_t j = i;
+        while (j > 0 && leak_grp[j-1].bytes < g.bytes){ leak_grp[j] = leak_grp[j-1]; j--; }
+        leak_grp[j] = g;
+    }
+    for (size_t i=0;i<=LEAK_GROUPS;i++) bytes += leak_grp[i].bytes;
+    if (fd >= 0){
+        dprintf(fd, "[mmu] leak report: %zu live blocks, %zu bytes\n", n, bytes);
+        if (n) dprintf(fd, "[mmu] %12s %8s %10s  %s\n", "bytes", "blocks", "size", "site");
+        for (size_t i=0;i<leak_ngrp && i<LEAK_ROWS;i++)
+            dprintf(fd, "[mmu] %12zu %8zu %10zu  %p\n", leak_grp[i].bytes,
+                    leak_grp[i].blocks, leak_grp[i].size, leak_grp[i].site);
+        if (leak_ngrp > LEAK_ROWS || leak_grp[LEAK_GROUPS].blocks){
+            size_t ob = leak_grp[LEAK_GROUPS].bytes, on = leak_grp[LEAK_GROUPS].blocks;
+            for (size_t i=LEAK_ROWS;i<leak_ngrp;i++){ ob += leak_grp[i].bytes; on += leak_grp[i].blocks; }
+            dprintf(fd, "[mmu] %12zu %8zu %10s  (other)\n", ob, on, "-");
+        }
+    }
+    lk_drop(&leak_lk);
+    return n;
+}
+static void leak_atexit(void){
+    int fd = atomic_load_explicit(&leak_fd, memory_order_relaxed);
+    if (fd >= 0) (void)allocator_leak_report(fd);
+}
+void allocator_leak_report_at_exit(int fd){
+    atomic_store_explicit(&leak_fd, fd, memory_order_relaxed);
+    if (fd >= 0 && !atomic_exchange_explicit(&leak_hooked, 1, memory_order_relaxed))
+        atexit(leak_atexit);
+}
+
+/* Replay
+ * Seed, wipe every heap back to one free block, then re-run the events
+ * straight against the recorded shard (no home shard, guard sampling or
+ * OOM handler in the way). With the same seed the skip-list levels come
+ * out the same, so every alloc must land on its recorded offset; we stop
+ * at the first one that does not. Live blocks are gone after this, so it
+ * is a lab tool, not something to call with a busy heap.
+ */
+static void heap_reset_all(void){
+    for (int i=0;i<NSHARD;i++){
+        lk_take(&shards[i].lk);
+        shards[i].inited = 0;
+        memset(&shards[i].st, 0, sizeof shards[i].st);
+        lk_drop(&shards[i].lk);
+    }
+    lk_take(&bud_lk);
+    b_inited = 0;
+    memset(&bst, 0, sizeof bst);
+    lk_drop(&bud_lk);
+    lk_take(&fib_lk);
+    f_inited = 0;
+    lk_drop(&fib_lk);
+    lk_take(&site_lk);
+    memset(site_ents, 0, sizeof site_ents);
+    site_map.n = 0;
+    atomic_store_explicit(&site_live, 0, memory_order_relaxed);
+    lk_drop(&site_lk);
+}
+static fit_fn fit_of(int strategy){
+    switch (strategy){
+        case ALLOC_STRATEGY_FIRST: return first_fit;
+        case ALLOC_STRATEGY_NEXT:  return next_fit;
+        case ALLOC_STRATEGY_BEST:  return best_fit;
+        case ALLOC_STRATEGY_WORST: return worst_fit;
+        default:                   return NULL;
+    }
+}
+size_t allocator_replay(const allocator_trace_event_t *ev, size_t n, unsigned int seed){
+    allocator_set_seed(seed);
+    heap_reset_all();
+    for (size_t i=0;i<n;i++){
+        const allocator_trace_event_t *e = &ev[i];
+        int buddy = e->strategy == ALLOC_STRATEGY_BUDDY;
+        int fib = e->strategy == ALLOC_STRATEGY_FIB;
+        if (!buddy && !fib && e->shard >= NSHARD) return i;
+        heap_t *h = buddy || fib ? NULL : &shards[e->shard];
+        if (e->op == ALLOC_TRACE_ALLOC){
+            void *p;
+            if (buddy) p = bud_take(e->size);
+            else if (fib) p = fib_take(e->size);
+            else{
+                fit_fn fn = fit_of(e->strategy);
+                if (!fn) return i;
+                p = shard_call(h, fn, e->strategy, ALIGN_UP(e->size), e->size);
+            }
+            char *base = buddy ? (char*)b_arena : fib ? (char*)f_arena : (char*)h->heap0;
+            if (!p || (size_t)((char*)p - base) != e->offset) return i;
+        }else if (e->op == ALLOC_TRACE_RESIZE){
+            if (!buddy) return i;
+            int ok = 0;
+            lk_take(&bud_lk);
+            char *p = (char*)b_arena + e->offset;
+            bud_t *b = b_inited ? bud_hdr(p) : NULL;
+            if (b && peek_magic(&b->magic) == MAGIC_A){
+                UNPOISON_META(b, BUDHDR);
+                ok = bud_resize(b, bud_order(e->size), e->size);
+                if (ok) MARK_RESIZE(p, e->size, b->sz - BUDHDR);
+                POISON(b, BUDHDR);
+            }
+            lk_drop(&bud_lk);
+            if (!ok) return i;
+        }else if (fib){
+            lk_take(&fib_lk);
+            if (f_inited) fib_free(fib_hdr((char*)f_arena + e->offset));
+            lk_drop(&fib_lk);
+        }else if (buddy){
+            lk_take(&bud_lk);
+            if (b_inited) bud_free(bud_hdr((char*)b_arena + e->offset));
+            lk_drop(&bud_lk);
+        }else{
+            lk_take(&h->lk);
+            if (h->inited) heap_free(h, heap_hdr(h, (char*)h->heap0 + e->offset));
+            lk_drop(&h->lk);
+        }
+    }
+    return n;
+}
+
+void allocator_set_seed(unsigned int seed){
+    for (int i=0;i<NSHARD;i++) lk_take(&shards[i].lk);
+    prng_seed = seed;
+    for (int i=0;i<NSHARD;i++) shards[i].prng = shard_seed(i);
+    for (int i=NSHARD-1;i>=0;i--) lk_drop(&shards[i].lk);
+}
+void allocator_reset_seed(void){
+    allocator_set_seed(PRNG_SEED);
+}
+void allocator_set_heap_limit(size_t per_shard){
+    if (per_shard < HEAP_SIZE)    per_shard = HEAP_SIZE;
+    if (per_shard > HEAP_RESERVE) per_shard = HEAP_RESERVE;
+    atomic_store_explicit(&heap_limit, per_shard & ~(size_t)7, memory_order_relaxed);
+}
+void allocator_set_buddy_trim(int on){
+    atomic_store_explicit(&bud_trim_on, on != 0, memory_order_relaxed);
+}
+int allocator_warmup(size_t heap_bytes, size_t buddy_bytes){
+    size_t lim = atomic_load_explicit(&heap_limit, memory_order_relaxed);
+    if (heap_bytes > lim) heap_bytes = lim;
+    if (buddy_bytes > BUD_SIZE) buddy_bytes = BUD_SIZE;
+    // frees do not trim the shards back below what was warmed
+    size_t f = atomic_load_explicit(&heap_floor, memory_order_relaxed);
+    while (f < heap_bytes && !atomic_compare_exchange_weak(&heap_floor, &f, heap_bytes)) {}
+    int rc = 0;
+    for (int i=0;i<NSHARD;i++){
+        heap_t *h = &shards[i];
+        lk_take(&h->lk);
+        if (!h->inited && heap_bootstrap(h) < 0) rc = -1;
+        else{
+            while (hlen(h) < heap_bytes && heap_grow(h, heap_bytes - hlen(h)) == 0) {}
+            if (hlen(h) < heap_bytes) rc = -1;
+            prefault(h->heap0, hlen(h));
+            prefault(h->bmap, BMAP_WORDS(hlen(h)) * 8);   // block-start bits too
+        }
+        lk_drop(&h->lk);
+    }
+    if (buddy_bytes){
+        lk_take(&bud_lk);
+        if (b_init() < 0) rc = -1;
+        else prefault(b_arena, buddy_bytes);
+        lk_drop(&bud_lk);
+    }
+    return rc;
+}
+void allocator_set_level_mode(allocator_level_mode_t mode){
+    atomic_store_explicit(&level_mode, (int)mode, memory_order_relaxed);
 }
 
 allocator_strategy_t allocator_current_strategy(void){
-    if (current_strategy >= ALLOC_STRATEGY_FIRST &&
-        current_strategy <= ALLOC_STRATEGY_BUDDY){
-        return (allocator_strategy_t)current_strategy;
+    int s = atomic_load_explicit(&current_strategy, memory_order_relaxed);
+    if (s >= ALLOC_STRATEGY_FIRST && s <= ALLOC_STRATEGY_FIB){
+        return (allocator_strategy_t)s;
     }
     return ALLOC_STRATEGY_FIRST;
 }
 
+static void lk_stats(lk_t *l, allocator_lock_stats_t *out){
+    if (!out) return;
+    lk_take(l);
+    l->acq--;                        // don't count our own peek
+    out->acquisitions = l->acq;
+    out->contended    = l->contended;
+    out->wait_ns      = l->wait_ns;
+    lk_drop(l);
+}
+void allocator_lock_stats(allocator_lock_stats_t *heap, allocator_lock_stats_t *buddy){
+    if (heap){
+        // fit heap = sum over shards
+        allocator_lock_stats_t sum = {0, 0, 0}, one;
+        for (int i=0;i<NSHARD;i++){
+            lk_stats(&shards[i].lk, &one);
+            sum.acquisitions += one.acquisitions;
+            sum.contended    += one.contended;
+            sum.wait_ns      += one.wait_ns;
+        }
+        *heap = sum;
+    }
+    lk_stats(&bud_lk, buddy);
+}
+void allocator_fib_lock_stats(allocator_lock_stats_t *fib){
+    lk_stats(&fib_lk, fib);
+}
+
+static void st_out(const hstat_t *st, allocator_heap_stats_t *out){
+    out->free_bytes   += st->free_bytes;
+    out->free_blocks  += st->free_blocks;
+    out->alloc_bytes  += st->alloc_bytes;
+    out->alloc_blocks += st->alloc_blocks;
+    out->splits       += st->splits;
+    out->merges       += st->merges;
+    out->index_searches += st->idx_searches;
+    out->index_hops     += st->idx_hops;
+}
+void allocator_heap_stats(allocator_heap_stats_t *heap, allocator_heap_stats_t *buddy){
+    if (heap){
+        memset(heap, 0, sizeof *heap);
+        for (int i=0;i<NSHARD;i++){
+            lk_take(&shards[i].lk);
+            st_out(&shards[i].st, heap);
+            heap->committed_bytes += shards[i].commit;
+            lk_drop(&shards[i].lk);
+        }
+        for (int s=ALLOC_STRATEGY_FIRST;s<=ALLOC_STRATEGY_WORST;s++)
+            heap->failures += atomic_load_explicit(&fail_strat[s], memory_order_relaxed);
+    }
+    if (buddy){
+        memset(buddy, 0, sizeof *buddy);
+        lk_take(&bud_lk);
+        st_out(&bst, buddy);
+        buddy->committed_bytes = b_arena ? BUD_SIZE : 0;
+        lk_drop(&bud_lk);
+        buddy->failures = atomic_load_explicit(&fail_strat[ALLOC_STRATEGY_BUDDY],
+                                               memory_order_relaxed);
+    }
+}
+
+void allocator_set_map_cache(size_t bytes){
+    atomic_store_explicit(&mapc_cap, bytes, memory_order_relaxed);
+    map_flush();
+}
+void allocator_map_stats(allocator_map_stats_t *out){
+    if (!out) return;
+    out->mmaps    = atomic_load_explicit(&map_calls, memory_order_relaxed);
+    out->munmaps  = atomic_load_explicit(&unmap_calls, memory_order_relaxed);
+    out->mremaps  = atomic_load_explicit(&remap_calls, memory_order_relaxed);
+    out->reused   = atomic_load_explicit(&mapc_hits, memory_order_relaxed);
+    out->parked   = atomic_load_explicit(&mapc_parks, memory_order_relaxed);
+    lk_take(&mapc_lk);
+    out->cached_bytes  = mapc_bytes;
+    out->cached_blocks = mapc_n;
+    lk_drop(&mapc_lk);
+}
+
+void allocator_fib_stats(allocator_heap_stats_t *fib){
+    if (!fib) return;
+    memset(fib, 0, sizeof *fib);
+    lk_take(&fib_lk);
+    st_out(&fst, fib);
+    fib->committed_bytes = f_arena ? F_SIZE : 0;
+    lk_drop(&fib_lk);
+    fib->failures = atomic_load_explicit(&fail_strat[ALLOC_STRATEGY_FIB], memory_order_relaxed);
+}
+
+allocator_oom_handler_t allocator_set_oom_handler(allocator_oom_handler_t fn){
+    return atomic_exchange_explicit(&oom_fn, fn, memory_order_acq_rel);
+}
+void allocator_oom_stats(allocator_oom_stats_t *out){
+    if (!out) return;
+    for (int s=0;s<=ALLOC_STRATEGY_FIB;s++)
+        out->by_strategy[s] = atomic_load_explicit(&fail_strat[s], memory_order_relaxed);
+    for (int k=0;k<ALLOC_FAIL_CLASSES;k++)
+        out->by_class[k] = atomic_load_explicit(&fail_class[k], memory_order_relaxed);
+}
+
 const char* allocator_strategy_name(allocator_strategy_t strategy){
     switch (strategy){
         case ALLOC_STRATEGY_FIRST: return "first-fit";
@@ -502,6 +2911,7 @@ const char* allocator_strategy_name(allocator_strategy_t strategy){
         case ALLOC_STRATEGY_BEST:  return "best-fit";
         case ALLOC_STRATEGY_WORST: return "worst-fit";
         case ALLOC_STRATEGY_BUDDY: return "buddy";
+        case ALLOC_STRATEGY_FIB:   return "fib-buddy";
         default:                   return "unknown";
     }
 }
@@ -1,8 +1,18 @@
 #include "allocator.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#ifdef MMU_ASAN
+#include <sanitizer/asan_interface.h>
+#endif
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 typedef void* (*alloc_fn)(size_t);
 
@@ -19,11 +29,729 @@ static void smoke_alloc(const char *label, alloc_fn fn){
     printf("✓ %s allocator handled allocate/free cycle\n", label);
 }
 
+static void* grab_in_thread(void *arg){
+    (void)arg;
+    return malloc_best_fit(64);
+}
+
+// a second thread lands on another shard; frees route back by address
+static void shard_routing(void){
+    char *mine = malloc_best_fit(64);
+    pthread_t t;
+    void *theirs = NULL;
+    assert(pthread_create(&t, NULL, grab_in_thread, NULL) == 0);
+    pthread_join(t, &theirs);
+    assert(mine && theirs);
+    uintptr_t gap = (uintptr_t)mine > (uintptr_t)theirs
+                  ? (uintptr_t)mine - (uintptr_t)theirs
+                  : (uintptr_t)theirs - (uintptr_t)mine;
+    assert(gap >= 4096 && "threads should get different shards");
+    my_free(theirs);
+    my_free(mine);
+    // both shards whole again: a near-full request fits
+    my_free(malloc_first_fit(3900));
+    void *whole = malloc_first_fit(3900);
+    assert(whole && "home shard did not coalesce back");
+    my_free(whole);
+    printf("✓ sharded heap routes frees to the owning shard\n");
+}
+
+// parked frees get merged in one go on the next allocation
+static void async_free(void){
+    void *blk[6];
+    for (int i = 0; i < 6; ++i){
+        blk[i] = malloc_first_fit(200);
+        assert(blk[i]);
+    }
+    const int order[6] = {3, 0, 5, 1, 4, 2};
+    for (int i = 0; i < 6; ++i){
+        my_free_async(blk[order[i]]);
+    }
+    my_free_async(blk[2]);              // double free must not corrupt the queue
+    void *whole = malloc_first_fit(3900);
+    assert(whole && "drain on allocation did not coalesce the batch");
+    my_free_async(whole);
+    allocator_drain_async();
+    whole = malloc_first_fit(3900);
+    assert(whole);
+    my_free(whole);
+    printf("✓ async frees drain and coalesce\n");
+}
+
+// counters track the heap without walking it
+static void heap_counters(void){
+    allocator_heap_stats_t before, st, bud;
+    allocator_heap_stats(&before, NULL);
+    char *p = malloc_best_fit(100);
+    assert(p);
+    allocator_heap_stats(&st, NULL);
+    assert(st.alloc_blocks == before.alloc_blocks + 1);
+    assert(st.alloc_bytes == before.alloc_bytes + 104 && "100 rounds up to 8");
+    assert(st.splits == before.splits + 1);
+    assert(st.free_bytes < before.free_bytes);
+    my_free(p);
+    allocator_heap_stats(&st, NULL);
+    assert(st.alloc_blocks == 0 && st.alloc_bytes == 0);
+    assert(st.free_bytes == before.free_bytes && st.free_blocks == before.free_blocks);
+    assert(st.merges > before.merges);
+    assert(!malloc_first_fit((size_t)1 << 20) && "1 MiB cannot fit a shard");
+    allocator_heap_stats(&st, &bud);
+    assert(st.failures == before.failures + 1);
+    assert(bud.alloc_blocks == 0 && bud.free_blocks == 1 && bud.free_bytes == 4096);
+    printf("✓ heap counters: %zu free bytes in %zu blocks\n", st.free_bytes, st.free_blocks);
+}
+
+static void *oom_cache[4];
+static int oom_calls;
+
+static int release_cache(size_t size, allocator_strategy_t strategy){
+    (void)size; (void)strategy;
+    ++oom_calls;
+    for (int i = 0; i < 4; ++i){
+        if (oom_cache[i]){
+            my_free(oom_cache[i]);
+            oom_cache[i] = NULL;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// OOM handler frees a "cache" entry and the allocation goes through on retry
+static void oom_handler(void){
+    for (int i = 0; i < 4; ++i){
+        oom_cache[i] = malloc_first_fit(3900);
+        assert(oom_cache[i] && "every shard should hold one 3900-byte block");
+    }
+    allocator_oom_stats_t before, after;
+    allocator_oom_stats(&before);
+    allocator_set_oom_handler(release_cache);
+    char *p = malloc_first_fit(2000);
+    assert(p && oom_calls == 1 && "handler should run once and unblock the retry");
+    allocator_oom_stats(&after);
+    assert(after.by_strategy[ALLOC_STRATEGY_FIRST] == before.by_strategy[ALLOC_STRATEGY_FIRST] + 1);
+    assert(after.by_class[11] == before.by_class[11] + 1);
+    assert(allocator_set_oom_handler(NULL) == release_cache);
+    my_free(p);
+    for (int i = 0; i < 4; ++i){
+        my_free(oom_cache[i]);
+        oom_cache[i] = NULL;
+    }
+    printf("✓ OOM handler can release memory and retry\n");
+}
+
+// realloc moves that find their arena full get the same retry
+static void oom_realloc(void){
+    allocator_set_oom_handler(release_cache);
+    char *b = malloc_buddy_alloc(1000);
+    oom_cache[0] = malloc_buddy_alloc(1000);
+    assert(b && oom_cache[0] && "two 2 KiB buddy blocks fill the arena");
+    b[0] = 'b';
+    oom_calls = 0;
+    char *nb = realloc_buddy(b, 3000);
+    assert(nb && nb[0] == 'b' && oom_calls == 1 && "buddy realloc should retry after the handler");
+    my_free(nb);
+    char *f = malloc_fib_buddy(1000);
+    oom_cache[0] = malloc_fib_buddy(2000);
+    assert(f && oom_cache[0] && "1424 + 2304 fill the Fibonacci arena");
+    f[0] = 'f';
+    oom_calls = 0;
+    char *nf = my_realloc(f, 2000);
+    assert(nf && nf[0] == 'f' && oom_calls == 1 && "fib realloc should retry after the handler");
+    my_free(nf);
+    assert(allocator_set_oom_handler(NULL) == release_cache);
+    printf("✓ realloc moves retry after the OOM handler\n");
+}
+
+// guarded block ends at a PROT_NONE page: one byte past the end faults
+static void guard_pages(void){
+    allocator_set_guard_sampling(ALLOC_STRATEGY_BEST, 1);
+    char *p = malloc_best_fit(104);
+    allocator_set_guard_sampling(ALLOC_STRATEGY_BEST, 0);
+    assert(p);
+    long page = sysconf(_SC_PAGESIZE);
+    assert(((uintptr_t)p + 104) % (uintptr_t)page == 0 && "payload not against the guard");
+    memset(p, 'g', 104);
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0){
+        int devnull = open("/dev/null", O_WRONLY);  // keep sanitizer reports quiet
+        if (devnull >= 0) dup2(devnull, 2);
+        p[104] = 'x';
+        _exit(0);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    // a sanitizer may catch the SEGV itself and exit non-zero instead
+    assert((WIFSIGNALED(status) || WEXITSTATUS(status) != 0) &&
+           "overflow into guard page did not fault");
+    my_free(p);
+    // sizes whose page rounding wraps: refused, not mapped short
+    allocator_set_guard_sampling(ALLOC_STRATEGY_BUDDY, 1);
+    allocator_set_guard_sampling(ALLOC_STRATEGY_FIRST, 1);
+    assert(!malloc_buddy_alloc(SIZE_MAX) && !malloc_buddy_alloc(SIZE_MAX - 100));
+    assert(!malloc_first_fit(SIZE_MAX) && !malloc_first_fit(SIZE_MAX - 100));
+    assert(!malloc_buddy_alloc(1 << 20) && "sampling made an oversize buddy request succeed");
+    allocator_set_guard_sampling(ALLOC_STRATEGY_FIB, 1);
+    assert(!malloc_fib_buddy(1 << 20));
+    allocator_set_guard_sampling(ALLOC_STRATEGY_FIB, 0);
+    allocator_set_guard_sampling(ALLOC_STRATEGY_BUDDY, 0);
+    allocator_set_guard_sampling(ALLOC_STRATEGY_FIRST, 0);
+    printf("✓ guard page catches overflow\n");
+}
+
+// frees of pointers we never handed out are dropped without touching anything
+static void bad_frees(void){
+    uint32_t *p = malloc_first_fit(256);
+    char *b = malloc_buddy_alloc(100);
+    allocator_set_guard_sampling(ALLOC_STRATEGY_BEST, 1);
+    char *g = malloc_best_fit(40);
+    allocator_set_guard_sampling(ALLOC_STRATEGY_BEST, 0);
+    assert(p && b && g);
+    for (int i = 0; i < 64; ++i) p[i] = 0xDEADBEEFU;  // looks like live header magic
+    allocator_heap_stats_t h0, b0, h1, b1;
+    allocator_heap_stats(&h0, &b0);
+    int local;
+    my_free((char*)p + 96);
+    my_free((char*)p + 8);
+    my_free(b + 8);
+    my_free(g + 8);
+    my_free(&local);
+    my_free((void*)(uintptr_t)0x10);
+    my_free_async((char*)p + 96);
+    allocator_drain_async();
+    allocator_heap_stats(&h1, &b1);
+    assert(h1.alloc_blocks == h0.alloc_blocks && h1.free_blocks == h0.free_blocks);
+    assert(b1.alloc_blocks == b0.alloc_blocks && b1.free_blocks == b0.free_blocks);
+    for (int i = 0; i < 64; ++i) assert(p[i] == 0xDEADBEEFU);
+    my_free(p);
+    my_free(b);
+    my_free(g);
+    printf("✓ invalid frees are ignored\n");
+}
+
+static size_t walk_live;
+static void count_live(const allocator_block_t *blk, void *arg){
+    const char *want = arg;
+    if (!blk->allocated) return;
+    walk_live++;
+    if (blk->ptr == want) assert(blk->size >= 40 && blk->arena >= 0);
+}
+static void check_root(const void *slot, const allocator_block_t *blk, void *arg){
+    char *const *bases = arg;
+    const char *v = *(char *const *)slot;
+    int i = (int)((char *const *)slot - (char *const *)bases) - 3;
+    assert(i >= 0 && i < 3 && blk->ptr == bases[i] && v >= bases[i]);
+}
+// the bitmaps find every block, and interior pointers find their block
+static void heap_walk(void){
+    char *a = malloc_best_fit(40);
+    char *b = malloc_buddy_alloc(100);
+    allocator_set_guard_sampling(ALLOC_STRATEGY_FIRST, 1);
+    char *g = malloc_first_fit(24);
+    allocator_set_guard_sampling(ALLOC_STRATEGY_FIRST, 0);
+    assert(a && b && g);
+
+    allocator_heap_stats_t hs, bs;
+    allocator_heap_stats(&hs, &bs);
+    walk_live = 0;
+    size_t n = allocator_walk(count_live, a);
+    assert(walk_live == hs.alloc_blocks + bs.alloc_blocks + 1);
+    assert(n == walk_live + hs.free_blocks + bs.free_blocks);
+
+    // slots 0-2 hold the bases, 3-5 interior pointers, then a header and junk
+    char *slots[8] = {a, b, g, a + 17, b + 99, g + 23, a - 4, (char*)slots};
+    size_t hits = allocator_scan_roots(slots + 3, slots + 8, check_root, slots);
+    assert(hits == 3 && "interior pointers not resolved to their blocks");
+
+    my_free(a);
+    my_free(b);
+    my_free(g);
+    printf("✓ heap walk sees %zu blocks, root scan resolves interior pointers\n", n);
+}
+
+// any byte of a live payload maps back to its base and size
+static void pointer_lookup(void){
+    char *a = malloc_worst_fit(100);
+    char *b = malloc_buddy_alloc(300);
+    assert(a && b);
+    void *base;
+    size_t size;
+    for (size_t k = 0; k < 100; k += 33){
+        assert(allocator_lookup(a + k, &base, &size) && base == a && size >= 100);
+    }
+    assert(allocator_lookup(b + 299, &base, &size) && base == b && size >= 300);
+    assert(!allocator_lookup(a - 1, NULL, NULL) && "header bytes are not payload");
+    assert(!allocator_lookup(&base, NULL, NULL));
+    my_free(a);
+    assert(!allocator_lookup(a, NULL, NULL) && "freed block still reported live");
+    my_free(b);
+    printf("✓ interior pointers map to their allocation\n");
+}
+
+// sampled leaks show up grouped by size with the site that made them
+// every sampled block comes from this one call site, however the loop
+// below gets unrolled; the asm keeps the call from becoming a tail jump
+static __attribute__((noinline)) void* leak_one(size_t size){
+    void *p = malloc_next_fit(size);
+    __asm__ volatile("" ::: "memory");
+    return p;
+}
+static void leak_report(void){
+    size_t base = allocator_leak_report(-1);
+    allocator_set_site_sampling(1);
+    char *leak[3];
+    for (int i = 0; i < 3; ++i) leak[i] = leak_one(40);
+    allocator_set_site_sampling(0);
+    assert(leak[0] && leak[1] && leak[2]);
+
+    FILE *f = tmpfile();
+    assert(f);
+    assert(allocator_leak_report(fileno(f)) == base + 3);
+    rewind(f);
+    char line[256];
+    int found = 0;
+    while (fgets(line, sizeof line, f)){
+        size_t bytes, blocks, size;
+        void *site;
+        if (sscanf(line, "[mmu] %zu %zu %zu %p", &bytes, &blocks, &size, &site) == 4 &&
+            blocks == 3 && size == 40 && site) found = 1;
+    }
+    fclose(f);
+    assert(found && "sampled leaks not grouped by site");
+    for (int i = 0; i < 3; ++i) my_free(leak[i]);
+    assert(allocator_leak_report(-1) == base);
+    printf("✓ leak report groups live blocks by size and site\n");
+}
+
+// strong definitions of the library's weak hooks
+static unsigned long hook_allocs, hook_frees, hook_maps, hook_unmaps;
+static size_t hook_map_len, hook_unmap_len;
+void allocator_on_alloc(void *ptr, size_t size, allocator_strategy_t strategy){
+    (void)ptr; (void)size; (void)strategy;
+    __atomic_fetch_add(&hook_allocs, 1, __ATOMIC_RELAXED);
+}
+void allocator_on_free(void *ptr){
+    (void)ptr;
+    __atomic_fetch_add(&hook_frees, 1, __ATOMIC_RELAXED);
+}
+void allocator_on_arena_map(void *base, size_t len){
+    (void)base;
+    hook_map_len = len;
+    __atomic_fetch_add(&hook_maps, 1, __ATOMIC_RELAXED);
+}
+void allocator_on_arena_unmap(void *base, size_t len){
+    (void)base;
+    hook_unmap_len = len;
+    __atomic_fetch_add(&hook_unmaps, 1, __ATOMIC_RELAXED);
+}
+static void event_hooks(void){
+    assert(hook_maps >= 2 && "shard and buddy arenas were mapped without a hook");
+    allocator_set_map_cache(0);         // every guarded block maps and unmaps
+    unsigned long a0 = hook_allocs, f0 = hook_frees, m0 = hook_maps, u0 = hook_unmaps;
+    char *p = malloc_first_fit(10);
+    assert(p && hook_allocs == a0 + 1);
+    my_free(p);
+    my_free(p);
+    assert(hook_frees == f0 + 1 && "double free reached the hook");
+    allocator_set_guard_sampling(ALLOC_STRATEGY_WORST, 1);
+    p = malloc_worst_fit(10);
+    allocator_set_guard_sampling(ALLOC_STRATEGY_WORST, 0);
+    assert(p && hook_maps == m0 + 1);
+    my_free(p);
+    assert(hook_unmaps == u0 + 1 && hook_frees == f0 + 2);
+    assert(hook_unmap_len == hook_map_len);
+    // a resize reports free + alloc whether or not the block moved
+    p = malloc_first_fit(100);
+    char *b = malloc_buddy_alloc(100);
+    assert(p && b);
+    unsigned long a1 = hook_allocs, f1 = hook_frees;
+    assert(my_realloc(p, 50) == p && realloc_buddy(b, 90) == b);
+    assert(hook_allocs == a1 + 2 && hook_frees == f1 + 2 && "in-place realloc skipped hooks");
+    my_free(p);
+    my_free(b);
+    allocator_set_map_cache(4 << 20);
+    printf("✓ weak hooks see %lu allocs, %lu frees, %lu arena maps\n",
+           hook_allocs, hook_frees, hook_maps);
+}
+
+// guarded blocks freed and re-made in waves reuse their mappings
+static void map_cache(void){
+    allocator_map_stats_t s0, s1;
+    allocator_map_stats(&s0);
+    allocator_set_guard_sampling(ALLOC_STRATEGY_FIRST, 1);
+    for (int round = 0; round < 3; ++round){
+        char *p[4];
+        for (int i = 0; i < 4; ++i){
+            p[i] = malloc_first_fit(100);
+            assert(p[i]);
+            memset(p[i], 'm', 100);
+        }
+        for (int i = 0; i < 4; ++i) my_free(p[i]);
+    }
+    allocator_set_guard_sampling(ALLOC_STRATEGY_FIRST, 0);
+    allocator_map_stats(&s1);
+    assert(s1.mmaps == s0.mmaps + 4 && s1.reused == s0.reused + 8);
+    assert(s1.munmaps == s0.munmaps && s1.parked == s0.parked + 12);
+    assert(s1.cached_blocks == 4);
+    allocator_set_map_cache(0);
+    allocator_map_stats(&s1);
+    assert(s1.munmaps == s0.munmaps + 4 && s1.cached_blocks == 0 && s1.cached_bytes == 0);
+    allocator_set_map_cache(4 << 20);
+    printf("✓ map cache: 12 guarded blocks, 4 mmaps, 0 munmaps\n");
+}
+
+// past the limit a shard commits more of its reservation, in place
+static void heap_growth(void){
+    allocator_heap_stats_t before, st;
+    my_free(malloc_first_fit(8));       // home shard built before the snapshot
+    allocator_heap_stats(&before, NULL);
+    allocator_set_heap_limit((size_t)1 << 20);
+    char *big = malloc_first_fit(200000);
+    assert(big && "shard did not grow into its reservation");
+    memset(big, 'v', 200000);
+    char *small = malloc_first_fit(64);
+    assert(small);
+    allocator_heap_stats(&st, NULL);
+    assert(st.committed_bytes >= before.committed_bytes + 200000 - 4096);
+    void *base;
+    assert(allocator_lookup(big + 199999, &base, NULL) && base == big);
+    size_t grown = st.committed_bytes;
+    my_free(small);
+    my_free(big);
+    allocator_heap_stats(&st, NULL);
+    assert(st.free_blocks == before.free_blocks && "growth left a seam behind");
+    // the free top block went back down to its slack, in whole steps
+    assert(st.committed_bytes == grown - 65536 && "free top block not trimmed");
+    // one free block spans the shard: stretching it costs just one step
+    size_t whole = st.free_bytes, had = st.committed_bytes;
+    char *top = malloc_first_fit(whole + 1000);
+    allocator_heap_stats(&st, NULL);
+    assert(top == big && st.committed_bytes == had + 65536 && "top block not extended in place");
+    my_free(top);
+    assert(!malloc_first_fit((size_t)2 << 20) && "grew past the limit");
+    allocator_set_heap_limit(4096);
+    printf("✓ shard grew to %zu committed bytes and merged back\n", st.committed_bytes);
+}
+
+// realloc keeps the bytes; large blocks are remapped, not copied
+static void realloc_blocks(void){
+    char *p = my_realloc(NULL, 20);
+    assert(p);
+    memcpy(p, "realloc-fit", 12);
+    p = my_realloc(p, 600);
+    assert(p && strcmp(p, "realloc-fit") == 0);
+    char *b = malloc_buddy_alloc(100);
+    assert(b);
+    memcpy(b, "realloc-buddy", 14);
+    b = my_realloc(b, 300);
+    void *base;
+    size_t size;
+    assert(b && strcmp(b, "realloc-buddy") == 0);
+    assert(allocator_lookup(b, &base, NULL) && base == b);
+    int local;
+    assert(!my_realloc(&local, 10) && "foreign pointer resized");
+
+    allocator_map_stats_t s0, s1;
+    allocator_set_large_threshold((size_t)1 << 20);
+    char *l = malloc_first_fit((size_t)2 << 20);
+    assert(l);
+    memset(l, 'L', (size_t)2 << 20);
+    allocator_map_stats(&s0);
+    char *g = my_realloc(l, (size_t)32 << 20);
+    assert(g && g[0] == 'L' && g[((size_t)2 << 20) - 1] == 'L');
+    g[((size_t)32 << 20) - 1] = 'e';
+    allocator_map_stats(&s1);
+    assert(s1.mremaps == s0.mremaps + 1 && s1.mmaps == s0.mmaps);
+    assert(allocator_lookup(g + 12345, &base, &size) && base == g && size == (size_t)32 << 20);
+    g = my_realloc(g, 4096);
+    assert(g && g[4095] == 'L');
+    my_free(g);
+    allocator_set_large_threshold(0);
+    assert(!my_realloc(p, 0));
+    my_free(b);
+    printf("✓ realloc moves fit/buddy blocks and mremaps large ones\n");
+}
+
+// a buddy block doubles into free buddies and sheds upper halves in place
+static void buddy_realloc(void){
+    allocator_heap_stats_t b0, st;
+    allocator_heap_stats(NULL, &b0);
+    char *b = malloc_buddy_alloc(100);
+    assert(b);
+    memcpy(b, "buddy-grow", 11);
+    char *g = realloc_buddy(b, 1000);
+    assert(g == b && strcmp(g, "buddy-grow") == 0 && "free buddies not absorbed");
+    memset(g + 11, 'x', 989);
+    g = realloc_buddy(g, 50);
+    assert(g == b && strcmp(g, "buddy-grow") == 0);
+    allocator_heap_stats(NULL, &st);
+    assert(st.alloc_bytes == b0.alloc_bytes + 128 && "upper halves not freed");
+    char *c = malloc_buddy_alloc(50);        // takes the buddy right above g
+    assert(c == g + 128);
+    char *m = realloc_buddy(g, 300);
+    assert(m && m != g && strcmp(m, "buddy-grow") == 0 && "grew over a live buddy");
+    my_free(c);
+    my_free(m);
+    allocator_heap_stats(NULL, &st);
+    assert(st.free_blocks == b0.free_blocks && st.alloc_bytes == b0.alloc_bytes);
+    // a sampled (guarded) buddy allocation still resizes
+    allocator_set_guard_sampling(ALLOC_STRATEGY_BUDDY, 1);
+    char *gb = malloc_buddy_alloc(100);
+    allocator_set_guard_sampling(ALLOC_STRATEGY_BUDDY, 0);
+    assert(gb);
+    memcpy(gb, "guarded", 8);
+    char *gm = realloc_buddy(gb, 200);
+    assert(gm && strcmp(gm, "guarded") == 0 && "guarded buddy block could not grow");
+    my_free(gm);
+    printf("✓ buddy realloc grows and shrinks in place, moves when blocked\n");
+}
+
+// with trimming a buddy block keeps only what it needs, rounded to 64
+static void buddy_trim(void){
+    allocator_heap_stats_t b0, st;
+    allocator_heap_stats(NULL, &b0);
+    allocator_set_buddy_trim(1);
+    char *a = malloc_buddy_alloc(1150);      // 2048 block, 1216 kept
+    assert(a);
+    memset(a, 't', 1150);
+    allocator_heap_stats(NULL, &st);
+    assert(st.alloc_bytes == b0.alloc_bytes + 1216 && "tail not trimmed");
+    void *base;
+    size_t size;
+    assert(allocator_lookup(a + 1149, &base, &size) && base == a && size < 1216);
+    char *b = malloc_buddy_alloc(200);       // tail went back as 64 + 256 + 512
+    assert(b && b == a + 1280);
+    assert(realloc_buddy(a, 100) == a && a[99] == 't' && "trimmed block moved to shrink");
+    assert(realloc_buddy(a, 1180) == a && "kept room not reused in place");
+    my_free(a);
+    my_free(b);
+    allocator_set_buddy_trim(0);
+    allocator_heap_stats(NULL, &st);
+    assert(st.free_blocks == b0.free_blocks && st.free_bytes == b0.free_bytes &&
+           "trimmed pieces did not merge back");
+    printf("✓ buddy tail trimming keeps 1216 of 2048 bytes\n");
+}
+
+// Fibonacci classes: 100 bytes takes a 208 byte block (binary buddy: 256)
+static void fib_buddy(void){
+    allocator_heap_stats_t st;
+    char *a = malloc_fib_buddy(100);
+    assert(a);
+    memcpy(a, "fib-ok", 7);
+    allocator_fib_stats(&st);
+    assert(st.alloc_blocks == 1 && st.alloc_bytes == 208);
+    void *base;
+    assert(allocator_lookup(a + 99, &base, NULL) && base == a);
+    char *blk[64];
+    int n = 0;
+    while (n < 64 && (blk[n] = malloc_fib_buddy(40 + (size_t)n * 13))) n++;
+    assert(n > 4 && n < 64 && "arena never filled up");
+    for (int i = 0; i < n; i += 2) my_free(blk[i]);
+    for (int i = 1; i < n; i += 2) my_free(blk[i]);
+    my_free(blk[0]);                          // double free, ignored
+    char *m = my_realloc(a, 600);
+    assert(m && strcmp(m, "fib-ok") == 0);
+    my_free(m);
+    allocator_fib_stats(&st);
+    assert(st.alloc_blocks == 0 && st.free_blocks == 1 && st.free_bytes == 3728 &&
+           "buddies did not merge back to one block");
+    assert(strcmp(allocator_strategy_name(ALLOC_STRATEGY_FIB), "fib-buddy") == 0);
+    printf("✓ fibonacci buddy splits %llu times and merges back\n", st.splits);
+}
+
+// ranges that are not memory: offsets only, merges back to one range
+static void range_alloc(void){
+    allocator_range_t *r = allocator_range_create(1000, 1000, 8);
+    allocator_range_stats_t st;
+    uint64_t a, b, c, d, e;
+    assert(r);
+    assert(allocator_range_alloc(r, 100, ALLOC_STRATEGY_FIRST, &a) == 0 && a == 1000);
+    assert(allocator_range_alloc(r, 200, ALLOC_STRATEGY_FIRST, &b) == 0 && b == 1100);
+    assert(allocator_range_alloc(r, 50, ALLOC_STRATEGY_BEST, &c) == 0 && c == 1300);
+    assert(allocator_range_free(r, b, 200) == 0);
+    assert(allocator_range_alloc(r, 150, ALLOC_STRATEGY_BEST, &b) == 0 && b == 1100);
+    assert(allocator_range_alloc(r, 100, ALLOC_STRATEGY_WORST, &d) == 0 && d == 1350);
+    assert(allocator_range_alloc(r, 40, ALLOC_STRATEGY_NEXT, &e) == 0 && e == 1450);
+    assert(allocator_range_alloc(r, 5000, ALLOC_STRATEGY_BEST, &a) == -1 && errno == ENOMEM);
+    assert(allocator_range_alloc(r, 10, ALLOC_STRATEGY_BUDDY, &a) == -1 && errno == EINVAL);
+    assert(allocator_range_free(r, 1500, 10) == -1 && errno == EINVAL);   // already free
+    assert(allocator_range_free(r, 10, 5) == -1 && errno == EINVAL);      // outside
+    allocator_range_stats(r, &st);
+    assert(st.free_ranges == 2 && st.free_bytes == 560 && st.largest_free == 510);
+    assert(allocator_range_free(r, 1000, 100) == 0);
+    assert(allocator_range_free(r, b, 150) == 0);
+    assert(allocator_range_free(r, e, 40) == 0);
+    assert(allocator_range_free(r, c, 50) == 0);
+    assert(allocator_range_free(r, d, 100) == 0);
+    assert(allocator_range_free(r, 1000, 100) == -1);                     // double free
+    allocator_range_stats(r, &st);
+    assert(st.free_ranges == 1 && st.free_bytes == 1000 && st.nodes_left == 7 &&
+           "ranges did not merge back to one");
+    assert(allocator_range_add(r, 3000, 500) == 0);
+    assert(allocator_range_add(r, 1990, 20) == -1);                       // overlaps free
+    assert(allocator_range_add(r, 1000, 100) == -1);                      // inside the span
+    allocator_range_stats(r, &st);
+    assert(st.managed_bytes == 2500 && st.free_ranges == 2 && st.largest_free == 1000);
+    allocator_range_destroy(r);
+
+    r = allocator_range_create(1000, 100, 16);
+    assert(allocator_range_alloc(r, 100, ALLOC_STRATEGY_FIRST, &a) == 0 && a == 1000);
+    assert(allocator_range_add(r, 1000, 100) == -1 && "re-added a live range");
+    assert(allocator_range_alloc(r, 100, ALLOC_STRATEGY_FIRST, &b) == -1);
+    allocator_range_destroy(r);
+
+    r = allocator_range_create(0, 100, 1);                               // one node only
+    assert(allocator_range_alloc(r, 10, ALLOC_STRATEGY_FIRST, &a) == 0);
+    assert(allocator_range_alloc(r, 10, ALLOC_STRATEGY_FIRST, &b) == 0);
+    assert(allocator_range_free(r, a, 10) == -1 && "no node left for a disjoint range");
+    assert(allocator_range_free(r, b, 10) == 0 && allocator_range_free(r, a, 10) == 0);
+    allocator_range_destroy(r);
+    printf("✓ range allocator fits and merges offsets\n");
+}
+
+static long minor_faults(void){
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_minflt;
+}
+
+// warmed memory is already faulted in: first touch costs nothing
+static void warmup(void){
+    allocator_heap_stats_t st, bst;
+    allocator_set_heap_limit((size_t)1 << 20);
+    assert(allocator_warmup((size_t)512 << 10, (size_t)64 << 10) == 0);
+    allocator_heap_stats(&st, &bst);
+    assert(st.committed_bytes >= (size_t)4 * (512 << 10) && bst.committed_bytes > 0);
+    long f0 = minor_faults();
+    char *p = malloc_first_fit(300000);
+    assert(p);
+    memset(p, 'w', 300000);
+    long faults = minor_faults() - f0;
+    assert(faults < 8 && "warmed heap still faults on first touch");  // 73 pages cold
+    my_free(p);
+    allocator_heap_stats(&st, NULL);
+    assert(st.committed_bytes >= (size_t)4 * (512 << 10) && "free trimmed warmed memory");
+    allocator_set_heap_limit(4096);
+    printf("✓ warmup: 300000 bytes touched with %ld minor faults\n", faults);
+}
+
+#ifdef MMU_ASAN
+// arena memory is shadowed: slack after the request and freed blocks are poisoned
+static void asan_shadow(void){
+    char *p = malloc_best_fit(13);
+    char *b = malloc_buddy_alloc(13);
+    assert(p && b);
+    assert(!__asan_region_is_poisoned(p, 13) && !__asan_region_is_poisoned(b, 13));
+    assert(__asan_address_is_poisoned(p + 13) && __asan_address_is_poisoned(b + 13));
+    assert(__asan_address_is_poisoned(p - 1) && "header of a live block is open");
+    my_free(p);
+    my_free(b);
+    assert(__asan_address_is_poisoned(p) && __asan_address_is_poisoned(b));
+    printf("✓ ASan sees arena block boundaries\n");
+}
+#endif
+
+static void* churn(void *arg){
+    size_t base = (size_t)(uintptr_t)arg;
+    void *keep[8];
+    for (int i = 0; i < 8; ++i){
+        keep[i] = malloc_best_fit(base + (size_t)i * 24);
+    }
+    for (int i = 0; i < 8; i += 2){
+        my_free(keep[i]);
+    }
+    for (int i = 1; i < 8; i += 2){
+        my_free(keep[i]);
+    }
+    return NULL;
+}
+
+// a recorded run replays onto the exact same offsets
+static void trace_replay(void){
+    allocator_trace_event_t ev[64];
+    allocator_set_seed(1234);
+    allocator_trace_start(ev, 64);
+    void *a = malloc_best_fit(300);
+    void *b = malloc_first_fit(120);
+    void *c = malloc_buddy_alloc(200);
+    void *d = malloc_worst_fit(40);
+    my_free(b);
+    void *e = malloc_next_fit(64);
+    my_free_async(a);
+    my_free(c);
+    void *f = malloc_best_fit(500);   // drains a first
+    my_free(d); my_free(e); my_free(f);
+    size_t n = allocator_trace_stop();
+    assert(n == 12 && "6 allocs, 6 frees");
+    assert(allocator_replay(ev, n, 1234) == n && "replay diverged");
+
+    // in-place buddy resizes and the Fibonacci arena replay too
+    allocator_trace_start(ev, 64);
+    char *g = malloc_buddy_alloc(100);
+    assert(realloc_buddy(g, 1000) == g && "buddy realloc did not grow in place");
+    void *k = malloc_buddy_alloc(100);
+    void *fb = malloc_fib_buddy(100);
+    my_free(g); my_free(k); my_free(fb);
+    size_t nr = allocator_trace_stop();
+    assert(nr == 7 && "3 allocs, 1 resize, 3 frees");
+    assert(allocator_replay(ev, nr, 1234) == nr && "resize replay diverged");
+
+    // shards keep their own level generators, so interleaved threads replay too
+    allocator_trace_event_t mt[128];
+    allocator_trace_start(mt, 128);
+    pthread_t t[3];
+    for (int i = 0; i < 3; ++i){
+        assert(pthread_create(&t[i], NULL, churn, (void*)(uintptr_t)(40 + 16 * i)) == 0);
+    }
+    for (int i = 0; i < 3; ++i){
+        pthread_join(t[i], NULL);
+    }
+    size_t m = allocator_trace_stop();
+    assert(m == 48);
+    assert(allocator_replay(mt, m, 1234) == m && "threaded replay diverged");
+    allocator_reset_seed();
+    printf("✓ trace of %zu events replays bit-for-bit\n", n);
+}
+
+static unsigned long long index_hops_for_seed(unsigned seed){
+    void *blk[12];
+    allocator_replay(NULL, 0, seed);
+    for (int i = 0; i < 12; ++i){
+        blk[i] = malloc_best_fit(40 + (size_t)i * 8);
+    }
+    for (int i = 0; i < 12; i += 3){
+        my_free(blk[i]);
+    }
+    void *probe = malloc_best_fit(48);
+    allocator_heap_stats_t st;
+    allocator_heap_stats(&st, NULL);
+    my_free(probe);
+    for (int i = 0; i < 12; ++i){
+        if (i % 3) my_free(blk[i]);
+    }
+    return st.index_hops;
+}
+
+// address-derived levels make the index shape independent of the PRNG seed
+static void address_levels(void){
+    allocator_set_level_mode(ALLOC_LEVELS_ADDRESS);
+    unsigned long long a = index_hops_for_seed(1), b = index_hops_for_seed(99);
+    allocator_set_level_mode(ALLOC_LEVELS_RANDOM);
+    allocator_reset_seed();
+    assert(a == b && "address levels should not depend on the seed");
+    printf("✓ address levels: same index cost (%llu hops) for any seed\n", a);
+}
+
 int main(void){
+    // everything but heap_growth sizes its blocks against one 4 KiB shard
+    allocator_set_heap_limit(4096);
     smoke_alloc("first-fit", malloc_first_fit);
     smoke_alloc("next-fit", malloc_next_fit);
     smoke_alloc("best-fit", malloc_best_fit);
     smoke_alloc("worst-fit", malloc_worst_fit);
+    shard_routing();
+    async_free();
 
     char *buddy = malloc_buddy_alloc(512);
     assert(buddy && "buddy allocator returned NULL");
@@ -31,6 +759,38 @@ int main(void){
     assert(strcmp(buddy, "buddy-ok") == 0);
     my_free(buddy);
     printf("✓ buddy allocator handled allocate/free cycle\n");
+    heap_counters();
+    oom_handler();
+    guard_pages();
+    bad_frees();
+    heap_walk();
+    pointer_lookup();
+    leak_report();
+    event_hooks();
+    map_cache();
+    trace_replay();
+    address_levels();
+    heap_growth();
+    warmup();
+    realloc_blocks();
+    buddy_realloc();
+    buddy_trim();
+    fib_buddy();
+    oom_realloc();
+    range_alloc();
+#ifdef MMU_ASAN
+    asan_shadow();
+#endif
+
+    allocator_lock_stats_t heap, bud, fib;
+    allocator_lock_stats(&heap, &bud);
+    allocator_fib_lock_stats(&fib);
+    assert(heap.acquisitions >= 16 && "fit heap lock not taken per alloc/free");
+    assert(bud.acquisitions >= 2 && "buddy lock not taken per alloc/free");
+    assert(fib.acquisitions >= 2 && "fib lock not taken per alloc/free");
+    assert(heap.contended == 0 && bud.contended == 0 && fib.contended == 0);
+    printf("✓ lock stats: heap %llu acq, buddy %llu acq, fib %llu acq\n",
+           heap.acquisitions, bud.acquisitions, fib.acquisitions);
 
     puts("All allocator smoke tests passed.");
     return 0;